@@ -0,0 +1,195 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  Inspire is copyright (C) 2002-2003 ChatSpike-Dev.
+ *                       E-mail:
+ *                <brain@chatspike.net>
+ *           	  <Craig@chatspike.net>
+ *
+ * Written by Craig Edwards, Craig McLure, and others.
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+/* casemapping benchmark. First checks casefold(), irc_equal() and the
+ * folding KeyedHash() against a plain walk through lowermap on random
+ * strings of every byte value, then times them against those byte at a
+ * time loops on three groups of realistic names: short nicks, long nicks
+ * and channel names. Each time is the best of nine runs. Build with
+ * "make bench" and run as bench/casemap. casemap.o picks SSE2 at compile
+ * time, so to time the 64 bit word code instead rebuild just casemap.o
+ * with -mno-sse2 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include "casemap.h"
+#include "siphash.h"
+
+using namespace std;
+
+#define CHECKS 2000000
+#define NAMES 4096
+#define ROUNDS 200
+#define RUNS 9
+
+/* the byte at a time versions these are measured against */
+
+void byte_lower(char* n)
+{
+	for (; *n; n++)
+		*n = lowermap[(unsigned char)*n];
+}
+
+int byte_equal(const char* a, const char* b)
+{
+	const unsigned char* x = (const unsigned char*)a;
+	const unsigned char* y = (const unsigned char*)b;
+
+	while ((*x) && (lowermap[*x] == lowermap[*y]))
+	{
+		x++;
+		y++;
+	}
+	return lowermap[*x] == lowermap[*y];
+}
+
+unsigned long long byte_hash(const char* s, size_t len)
+{
+	char a[80];
+
+	for (size_t i = 0; i < len; i++)
+		a[i] = lowermap[(unsigned char)s[i]];
+	return KeyedHash((const unsigned char*)a,len,0);
+}
+
+double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int check()
+{
+	char a[80], b[80], c[80], d[80];
+
+	srand(1);
+	for (int t = 0; t < CHECKS; t++)
+	{
+		int len = rand() % 70;
+		for (int i = 0; i < len; i++)
+		{
+			a[i] = 1 + rand() % 255;
+		}
+		a[len] = 0;
+		/* b is a with some characters put in the other case and a
+		 * few changed altogether */
+		for (int i = 0; i < len; i++)
+		{
+			unsigned char ch = a[i];
+			int r = rand() % 4;
+			if (r == 0)
+				b[i] = lowermap[ch];
+			else if ((r == 1) && (ch >= 0x61) && (ch <= 0x7d))
+				b[i] = ch - 0x20;
+			else if ((r == 2) && (rand() % 20 == 0))
+				b[i] = 1 + rand() % 255;
+			else
+				b[i] = ch;
+		}
+		b[len] = 0;
+		memcpy(c,a,len + 1);
+		casefold(c,c,len);
+		memcpy(d,a,len + 1);
+		byte_lower(d);
+		if (memcmp(c,d,len + 1))
+		{
+			printf("casefold() differs from lowermap on a %d character string\n",len);
+			return 0;
+		}
+		if (irc_equal(a,b) != byte_equal(a,b))
+		{
+			printf("irc_equal() differs from lowermap on a %d character string\n",len);
+			return 0;
+		}
+		if (KeyedHash((const unsigned char*)a,len,1) != KeyedHash((const unsigned char*)d,len,0))
+		{
+			printf("KeyedHash() folds differently from lowermap on a %d character string\n",len);
+			return 0;
+		}
+	}
+	printf("%d random strings, casefold(), irc_equal() and KeyedHash() agree with lowermap\n",CHECKS);
+	return 1;
+}
+
+#define BENCH(label,body) \
+	best = 1e9; \
+	for (int run = 0; run < RUNS; run++) \
+	{ \
+		double start = now(); \
+		for (int r = 0; r < ROUNDS; r++) \
+			for (unsigned int i = 0; i < NAMES; i++) \
+			{ \
+				body; \
+			} \
+		if (now() - start < best) \
+			best = now() - start; \
+	} \
+	printf("  %-26s %6.1f ns/name\n",label,best * 1e9 / (ROUNDS * NAMES));
+
+int main(int argc, char** argv)
+{
+	const char* parts[] = { "Nick", "[AFK]", "Guest", "Brain", "Craig_", "{zzz}", "W0rD", "ChanServ" };
+	const char* groups[] = { "short nicks", "long nicks", "channels" };
+	volatile unsigned long long sink = 0;
+	double best;
+
+	InitHashKey();
+	if (!check())
+	{
+		return 1;
+	}
+	for (int g = 0; g < 3; g++)
+	{
+		vector<string> names, upper, work;
+		double total = 0;
+		char n[80];
+
+		for (int i = 0; i < NAMES; i++)
+		{
+			if (g == 0)
+				snprintf(n,80,"%s%d",parts[i % 8],i % 1000);
+			else if (g == 1)
+				snprintf(n,80,"%s|%s%d",parts[i % 8],parts[(i / 8) % 8],i);
+			else
+				snprintf(n,80,"#%s-%s-%s-%d",parts[i % 8],parts[(i / 3) % 8],parts[(i / 7) % 8],i);
+			names.push_back(n);
+			for (char* p = n; *p; p++)
+			{
+				if ((*p >= 'a') && (*p <= '}'))
+					*p -= 0x20;
+			}
+			upper.push_back(n);
+			total += names.back().length();
+		}
+		work = upper;
+		printf("%s, %.1f characters on average\n",groups[g],total / NAMES);
+		BENCH("strlower, byte loop",byte_lower(&work[i][0]); sink += work[i][0])
+		BENCH("strlower, casefold()",char* p = &work[i][0]; casefold(p,p,strlen(p)); sink += work[i][0])
+		BENCH("table compare, byte loop",sink += byte_equal(names[i].c_str(),upper[i].c_str()))
+		BENCH("table compare, casefold_eq",sink += (names[i].length() == upper[i].length()) && casefold_eq(names[i].data(),upper[i].data(),names[i].length()))
+		BENCH("irc_equal()",sink += irc_equal(names[i].c_str(),upper[i].c_str()))
+		BENCH("strcasecmp(), no []\\",sink += !strcasecmp(names[i].c_str(),upper[i].c_str()))
+		BENCH("hash, byte fold then hash",sink += byte_hash(upper[i].data(),upper[i].length()))
+		BENCH("hash, KeyedHash() folding",sink += KeyedHash((const unsigned char*)upper[i].data(),upper[i].length(),1))
+	}
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  Inspire is copyright (C) 2002-2003 ChatSpike-Dev.
+ *                       E-mail:
+ *                <brain@chatspike.net>
+ *           	  <Craig@chatspike.net>
+ *
+ * Written by Craig Edwards, Craig McLure, and others.
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+/* hash flooding benchmark. Works out, the way an attacker could offline,
+ * a batch of names which all land on the first slot of the table under
+ * the unkeyed FNV-1a hash the nick table used to have, then puts them in
+ * a table next to 8000 ordinary nicks and times looking them up. This is
+ * done with that unkeyed hash and with the keyed StrHash the server uses
+ * (hashcomp.h). Under the key the names spread out like any others, so
+ * the keyed lookups should stay flat as the batch grows. Build with
+ * "make bench" and run as bench/hashflood [names] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include "flathash.h"
+#include "hashcomp.h"
+
+using namespace std;
+
+/* the nick table's hash before it was keyed */
+
+struct FnvHash
+{
+	size_t operator()(const char* s) const
+	{
+		size_t h = (size_t)14695981039346656037ULL;
+		for (const unsigned char* p = (const unsigned char*)s; *p; p++)
+			h = (h ^ lowermap[*p]) * (size_t)1099511628211ULL;
+		return h;
+	}
+	size_t operator()(const string &s) const
+	{
+		return (*this)(s.c_str());
+	}
+};
+
+double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+template <class H> void run(const char* label, vector<string> &normal, vector<string> &attack, unsigned int count)
+{
+	flat_hash<string,int,H,StrHashComp> table;
+	long found = 0;
+	int rounds = 10;
+
+	for (unsigned int i = 0; i < normal.size(); i++)
+	{
+		table[normal[i]] = 1;
+	}
+	double start = now();
+	for (unsigned int i = 0; i < count; i++)
+	{
+		table[attack[i]] = 1;
+	}
+	double insert = now() - start;
+	start = now();
+	for (int r = 0; r < rounds; r++)
+	{
+		for (unsigned int i = 0; i < count; i++)
+		{
+			found += (table.find(attack[i].c_str()) != table.end());
+		}
+	}
+	double lookup = now() - start;
+	unsigned long hist[FH_PROBEBUCKETS];
+	table.probe_stats(hist);
+	printf("%5u %-8s %6lu slots, insert %7.2fms, %7.1f ns/lookup, probes 0:%lu 1:%lu 2-3:%lu 4-7:%lu 8+:%lu\n",
+		count,label,(unsigned long)table.slot_count(),insert * 1e3,lookup * 1e9 / (rounds * count),
+		hist[0],hist[1],hist[2],hist[3],hist[4]);
+}
+
+int main(int argc, char** argv)
+{
+	unsigned int most = (argc > 1) ? atoi(argv[1]) : 4000;
+	if (most < 8)
+	{
+		most = 8;
+	}
+	vector<string> normal, attack;
+	char name[32];
+	FnvHash fnv;
+
+	InitHashKey();
+	for (int i = 0; i < 8000; i++)
+	{
+		snprintf(name,32,"user%d",i);
+		normal.push_back(name);
+	}
+	/* flat_hash takes a key's slot from the top bits of the hash times
+	 * a constant (see home() in flathash.h). Names for which the low 15
+	 * of those bits are zero share slot 0 in any table of up to 32768
+	 * slots */
+	for (unsigned long i = 0; attack.size() < most; i++)
+	{
+		snprintf(name,32,"x%lx",i);
+		unsigned long long h = (unsigned long long)fnv(name) * 0x9E3779B97F4A7C15ULL;
+		if (((h >> 32) & 0x7fff) == 0)
+		{
+			attack.push_back(name);
+		}
+	}
+	for (unsigned int count = most / 8; count <= most; count *= 2)
+	{
+		run<FnvHash>("unkeyed",normal,attack,count);
+		run<StrHash>("keyed",normal,attack,count);
+	}
+	return 0;
+}
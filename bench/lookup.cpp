@@ -0,0 +1,145 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  Inspire is copyright (C) 2002-2003 ChatSpike-Dev.
+ *                       E-mail:
+ *                <brain@chatspike.net>
+ *           	  <Craig@chatspike.net>
+ *
+ * Written by Craig Edwards, Craig McLure, and others.
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+/* nick table lookup benchmark. Fills a table with 50000 nicks and times
+ * looking up twice as many names, half of them nicks in the table with
+ * their case changed (every other one writing [] as {}) and half channel
+ * names which are not there. This is run with the hash and comparison
+ * the server uses (hashcomp.h) and with the ones it used to have, which
+ * copied each key into a buffer and lowercased it there. Build with
+ * "make bench" and run as bench/lookup [nicks] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include "flathash.h"
+#include "hashcomp.h"
+
+#define MAXBUF 514
+
+using namespace std;
+
+/* the old strlower(), strlen() and all */
+
+void old_strlower(char *n)
+{
+	for (unsigned int i = 0; i <= strlen(n); i++)
+	{
+		n[i] = tolower(n[i]);
+		if (n[i] == '[')
+			n[i] = '{';
+		if (n[i] == ']')
+			n[i] = '}';
+		if (n[i] == '\\')
+			n[i] = '|';
+	}
+}
+
+/* the old hash<string>, which ended in the SGI hash<const char*> */
+
+struct OldHash
+{
+	size_t operator()(const string &s) const
+	{
+		char a[MAXBUF];
+		unsigned long h = 0;
+		strcpy(a,s.c_str());
+		old_strlower(a);
+		for (const char* p = a; *p; p++)
+			h = 5*h + *p;
+		return h;
+	}
+};
+
+struct OldComp
+{
+	bool operator()(const string& s1, const string& s2) const
+	{
+		char a[MAXBUF],b[MAXBUF];
+		strcpy(a,s1.c_str());
+		strcpy(b,s2.c_str());
+		return (strcasecmp(a,b) == 0);
+	}
+};
+
+double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* times every probe through a table of type T, looking up by string
+ * (the old Find()) or by char* (FindChan() and friends now) */
+
+template <class T> void run(const char* label, vector<string> &keys, vector<string> &probes, bool by_string)
+{
+	T table;
+	long found = 0;
+	int rounds = 20;
+
+	for (unsigned int i = 0; i < keys.size(); i++)
+	{
+		table[keys[i]] = i + 1;
+	}
+	double start = now();
+	for (int r = 0; r < rounds; r++)
+	{
+		for (unsigned int i = 0; i < probes.size(); i++)
+		{
+			if (by_string)
+				found += (table.find(probes[i]) != table.end());
+			else
+				found += (table.find(probes[i].c_str()) != table.end());
+		}
+	}
+	double taken = now() - start;
+	printf("%-34s %7.1f ns/lookup, %ld of %ld found\n",label,taken * 1e9 / (rounds * probes.size()),found / rounds,(long)probes.size() / 2);
+}
+
+int main(int argc, char** argv)
+{
+	int count = (argc > 1) ? atoi(argv[1]) : 50000;
+	vector<string> keys, probes;
+	char name[MAXBUF];
+
+	InitHashKey();
+	for (int i = 0; i < count; i++)
+	{
+		snprintf(name,MAXBUF,"User[%d]Nick",i);
+		keys.push_back(name);
+	}
+	for (int i = 0; i < count * 2; i++)
+	{
+		if (i % 2)
+			snprintf(name,MAXBUF,(i % 4 == 1) ? "uSER{%d}nICK" : "uSER[%d]nICK",i / 2);
+		else
+			snprintf(name,MAXBUF,"#Chan%d",i);
+		probes.push_back(name);
+	}
+	for (int k = 0; k < 2; k++)
+	{
+		run< flat_hash<string,long,OldHash,OldComp> >("old hash and compare, by string",keys,probes,true);
+		run< flat_hash<string,long,StrHash,StrHashComp> >("StrHash/StrHashComp, by string",keys,probes,true);
+		run< flat_hash<string,long,StrHash,StrHashComp> >("StrHash/StrHashComp, by char*",keys,probes,false);
+	}
+	return 0;
+}
@@ -0,0 +1,162 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  Inspire is copyright (C) 2002-2003 ChatSpike-Dev.
+ *                       E-mail:
+ *                <brain@chatspike.net>
+ *           	  <Craig@chatspike.net>
+ *
+ * Written by Craig Edwards, Craig McLure, and others.
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "casemap.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const unsigned char lowermap[256] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+	32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47,
+	48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63,
+	64, 97, 98, 99, 100, 101, 102, 103, 104, 105, 106, 107, 108, 109, 110, 111,
+	112, 113, 114, 115, 116, 117, 118, 119, 120, 121, 122, 123, 124, 125, 94, 95,
+	96, 97, 98, 99, 100, 101, 102, 103, 104, 105, 106, 107, 108, 109, 110, 111,
+	112, 113, 114, 115, 116, 117, 118, 119, 120, 121, 122, 123, 124, 125, 126, 127,
+	128, 129, 130, 131, 132, 133, 134, 135, 136, 137, 138, 139, 140, 141, 142, 143,
+	144, 145, 146, 147, 148, 149, 150, 151, 152, 153, 154, 155, 156, 157, 158, 159,
+	160, 161, 162, 163, 164, 165, 166, 167, 168, 169, 170, 171, 172, 173, 174, 175,
+	176, 177, 178, 179, 180, 181, 182, 183, 184, 185, 186, 187, 188, 189, 190, 191,
+	192, 193, 194, 195, 196, 197, 198, 199, 200, 201, 202, 203, 204, 205, 206, 207,
+	208, 209, 210, 211, 212, 213, 214, 215, 216, 217, 218, 219, 220, 221, 222, 223,
+	224, 225, 226, 227, 228, 229, 230, 231, 232, 233, 234, 235, 236, 237, 238, 239,
+	240, 241, 242, 243, 244, 245, 246, 247, 248, 249, 250, 251, 252, 253, 254, 255
+};
+
+/* the functions below work through the names sixteen characters at a
+ * time with SSE2 where the compiler has it (every x86-64 does), or eight
+ * at a time in an ordinary 64 bit word, finishing with one block which
+ * overlaps the last so that only names shorter than a word are done a
+ * character at a time. Names are short, so there is nothing to gain from
+ * wider registers or from choosing between versions at run time */
+
+#ifdef __SSE2__
+#define BLOCK 16
+
+static inline __m128i fold16(__m128i v)
+{
+	/* signed compares, so characters from 0x80 up are never in range */
+	__m128i in = _mm_and_si128(_mm_cmpgt_epi8(v,_mm_set1_epi8(0x40)),_mm_cmplt_epi8(v,_mm_set1_epi8(0x5e)));
+
+	return _mm_or_si128(v,_mm_and_si128(in,_mm_set1_epi8(0x20)));
+}
+
+static inline void fold_block(char* dst, const char* src)
+{
+	_mm_storeu_si128((__m128i*)dst,fold16(_mm_loadu_si128((const __m128i*)src)));
+}
+
+static inline int eq_block(const char* a, const char* b)
+{
+	__m128i va = fold16(_mm_loadu_si128((const __m128i*)a));
+	__m128i vb = fold16(_mm_loadu_si128((const __m128i*)b));
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(va,vb)) == 0xffff;
+}
+#else
+#define BLOCK 8
+#endif
+
+static inline void fold_8(char* dst, const char* src)
+{
+	unsigned long long w;
+
+	memcpy(&w,src,8);
+	w = fold_word(w);
+	memcpy(dst,&w,8);
+}
+
+static inline int eq_8(const char* a, const char* b)
+{
+	unsigned long long wa, wb;
+
+	memcpy(&wa,a,8);
+	memcpy(&wb,b,8);
+	return fold_word(wa) == fold_word(wb);
+}
+
+#ifndef __SSE2__
+#define fold_block fold_8
+#define eq_block eq_8
+#endif
+
+void casefold(char* dst, const char* src, size_t len)
+{
+	size_t i;
+
+	if (len >= BLOCK)
+	{
+		/* folding is the same however many times it is done, so the
+		 * last block may go over characters already folded */
+		for (i = 0; i + BLOCK < len; i += BLOCK)
+		{
+			fold_block(dst + i,src + i);
+		}
+		fold_block(dst + len - BLOCK,src + len - BLOCK);
+	}
+	else if (len >= 8)
+	{
+		fold_8(dst,src);
+		fold_8(dst + len - 8,src + len - 8);
+	}
+	else
+	{
+		for (i = 0; i < len; i++)
+		{
+			dst[i] = lowermap[(unsigned char)src[i]];
+		}
+	}
+}
+
+int casefold_eq(const char* a, const char* b, size_t len)
+{
+	size_t i;
+
+	if (len >= BLOCK)
+	{
+		for (i = 0; i + BLOCK < len; i += BLOCK)
+		{
+			if (!eq_block(a + i,b + i))
+			{
+				return 0;
+			}
+		}
+		return eq_block(a + len - BLOCK,b + len - BLOCK);
+	}
+	if (len >= 8)
+	{
+		return (eq_8(a,b)) && (eq_8(a + len - 8,b + len - 8));
+	}
+	for (i = 0; i < len; i++)
+	{
+		if (lowermap[(unsigned char)a[i]] != lowermap[(unsigned char)b[i]])
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int irc_equal(const char* a, const char* b)
+{
+	/* folding never changes the length of a name */
+	size_t len = strlen(a);
+
+	return (strlen(b) == len) && (casefold_eq(a,b,len));
+}
@@ -0,0 +1,56 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  Inspire is copyright (C) 2002-2003 ChatSpike-Dev.
+ *                       E-mail:
+ *                <brain@chatspike.net>
+ *           	  <Craig@chatspike.net>
+ *
+ * Written by Craig Edwards, Craig McLure, and others.
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include <stddef.h>
+
+#ifndef __CASEMAP_H__
+#define __CASEMAP_H__
+
+/* RFC 1459 casemapping, every character mapped to its lower case. As well
+ * as A-Z, the characters []\ are the upper case of {}|, see strlower().
+ * Between them that is every character from A (0x41) to ] (0x5d), and
+ * each one's lower case is 0x20 above it, which is what lets the
+ * functions below fold several characters at once */
+
+extern const unsigned char lowermap[256];
+
+/* folds the eight characters packed in w to lower case */
+
+inline unsigned long long fold_word(unsigned long long w)
+{
+	const unsigned long long high = 0x8080808080808080ULL;
+	unsigned long long x = w & ~high;
+	unsigned long long above_a = x + 0x3f3f3f3f3f3f3f3fULL;	/* top bit set if >= 0x41 */
+	unsigned long long above_z = x + 0x2222222222222222ULL;	/* top bit set if >= 0x5e */
+
+	return w | ((above_a & ~above_z & ~w & high) >> 2);
+}
+
+/* copies len characters from src to dst folding them to lower case on the
+ * way, dst may be src */
+
+void casefold(char* dst, const char* src, size_t len);
+
+/* returns nonzero if the first len characters of a and b are the same
+ * once folded to lower case */
+
+int casefold_eq(const char* a, const char* b, size_t len);
+
+/* returns nonzero if two names are the same under the casemapping above */
+
+int irc_equal(const char* a, const char* b);
+
+#endif
@@ -1,11 +1,17 @@
 #include "inspircd_config.h"
 #include <time.h>
+#include <vector>
+#include <string>
 
 #ifndef __CHANNELS_H__
 #define __CHANNELS_H__
 
-/* this struct doesn't need a userlist member because we can figure this out
- * by enumerating the user array */
+struct userrec;
+struct ucrec;
+
+/* members lists the users on the channel, each entry pointing at the ucrec
+ * in that user's own channel list, so a user's status on the channel is
+ * only kept in one place */
 
 struct chanrec {
 	char name[CHANMAX]; /* channel name */
@@ -23,10 +29,15 @@ struct chanrec {
 	short int moderated;
 	short int secret;
 	short int c_private;
+	std::vector<struct ucrec*> members; /* users on the channel, see join_member() */
+	unsigned long epoch; /* last time this channel was marked, see common_channels() */
+	std::vector<std::string> names; /* pre-rendered NAMES entries, see userlist() */
+	bool names_valid; /* false when names must be rebuilt from members */
 };
 
 /* used to hold a channel and a users modes on that channel, e.g. +v, +h, +o
- * needs to come AFTER struct chanrec */
+ * needs to come AFTER struct chanrec. There is one for each user on each
+ * channel, shared by the user's channel list and the channel's members */
 
 #define UCMODE_OP      1
 #define UCMODE_VOICE   2
@@ -37,6 +48,8 @@ struct chanrec {
 struct ucrec {
 	long uc_modes; /* modes related to both user and channel, e.g. +o */
 	struct chanrec *channel; /* actual channel this refers to */
+	struct userrec *user; /* user this record belongs to */
+	unsigned int member; /* where this record is in channel->members */
 };
 
 #endif
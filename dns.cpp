@@ -0,0 +1,521 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  Inspire is copyright (C) 2002-2003 ChatSpike-Dev.
+ *                       E-mail:
+ *                <brain@chatspike.net>
+ *           	  <Craig@chatspike.net>
+ *
+ * Written by Craig Edwards, Craig McLure, and others.
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd.h"
+#include "dns.h"
+#include "siphash.h"
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <map>
+#include <list>
+#include <string>
+
+using namespace std;
+
+/* a small non-blocking stub resolver. Queries go out over UDP to a single
+ * nameserver and the answers are picked up by ResolverRead() when the
+ * socket engine says the socket is readable, so a slow or dead nameserver
+ * never holds up the main loop. Only what AddClient() needs is here: a PTR
+ * lookup, then an A lookup of the answer to check it points back at the
+ * same address */
+
+#define DNS_TYPE_A	1
+#define DNS_TYPE_PTR	12
+#define DNS_CLASS_IN	1
+
+static int resolver = -1;
+static struct sockaddr_in nameserver;
+static int querytimeout = 5;
+static map<unsigned short, dnsrec*> queries;	/* lookups in flight, by query id */
+static unsigned long long query_serial = 0;	/* input for the next query id, see SendQuery() */
+
+/* the host cache remembers the result of each lookup, including failed
+ * ones, for as long as its TTL allows so that a client reconnecting (or a
+ * few thousand of them after a netsplit) doesn't cost a trip to the
+ * nameserver. It is an LRU list, most recently used first, indexed by
+ * address and trimmed to cachemax entries */
+
+#define NEGATIVE_TTL	60	/* seconds to remember a failed lookup */
+#define MAXIMUM_TTL	86400	/* cap on how long a good answer is kept */
+
+struct hostentry {
+	in_addr_t ip;
+	time_t expires;
+	string host;		/* empty if the lookup failed */
+};
+
+typedef list<hostentry> host_list;
+/* keyed like the nick and channel tables, since whoever connects picks
+ * the addresses which end up in here */
+
+struct AddrHash
+{
+	size_t operator()(in_addr_t a) const
+	{
+		return KeyedHash((const unsigned char*)&a,sizeof(a),0);
+	}
+};
+
+struct AddrHashComp
+{
+	bool operator()(in_addr_t a, in_addr_t b) const
+	{
+		return a == b;
+	}
+};
+
+typedef flat_hash<in_addr_t, host_list::iterator, AddrHash, AddrHashComp> host_cache;
+
+static host_list lru;
+static host_cache hosts;
+static struct cachestats cache = { 0, 4096, 0, 0, 0 };
+
+void LookupTimeout(struct timerec* timer, time_t now);
+
+dnsrec::dnsrec() : stage(DNS_IDLE), id(0), handler(NULL), data(NULL), ttl(0), cached(false)
+{
+	ip.s_addr = 0;
+	host[0] = '\0';
+}
+
+dnsrec::~dnsrec()
+{
+	CancelLookup(this);
+}
+
+int ResolverInit(char* server, int port, int timeout, int cachesize)
+{
+	char line[MAXBUF], addr[MAXBUF];
+	FILE* f;
+
+	strcpy(addr,server ? server : "");
+	if (!*addr)
+	{
+		if ((f = fopen("/etc/resolv.conf","r")))
+		{
+			while (fgets(line,MAXBUF,f))
+			{
+				if (sscanf(line,"nameserver %s",addr) == 1)
+				{
+					break;
+				}
+			}
+			fclose(f);
+		}
+	}
+	if (!*addr)
+	{
+		strcpy(addr,"127.0.0.1");
+	}
+
+	memset(&nameserver,0,sizeof(nameserver));
+	nameserver.sin_family = AF_INET;
+	nameserver.sin_port = htons(port > 0 ? port : 53);
+	if (!inet_aton(addr,&nameserver.sin_addr))
+	{
+		debug("ResolverInit: bad nameserver address %s",addr);
+		return -1;
+	}
+	querytimeout = timeout > 0 ? timeout : 5;
+	cache.max = cachesize > 0 ? cachesize : 4096;
+
+	if ((resolver = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+	{
+		debug("ResolverInit: can't create socket: %s",strerror(errno));
+		return -1;
+	}
+	fcntl(resolver, F_SETFL, fcntl(resolver, F_GETFL, 0) | O_NONBLOCK);
+	fcntl(resolver, F_SETFD, FD_CLOEXEC);
+
+	debug("ResolverInit: using nameserver %s:%d, fd %d",addr,ntohs(nameserver.sin_port),resolver);
+	return resolver;
+}
+
+/* builds a query for name in buf, returns its length or -1 if the name
+ * won't fit */
+
+static int MakeQuery(unsigned char* buf, unsigned short id, char* name, int type)
+{
+	int len = 12;
+	char* label = name;
+
+	memset(buf,0,12);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xff;
+	buf[2] = 0x01;		/* RD, recursion desired */
+	buf[5] = 1;		/* one question */
+
+	while (*label)
+	{
+		char* dot = strchr(label,'.');
+		int n = dot ? dot - label : strlen(label);
+		if ((n < 1) || (n > 63) || (len + n + 6 > 12 + 255))
+		{
+			return -1;
+		}
+		buf[len++] = n;
+		memcpy(buf+len,label,n);
+		len += n;
+		label += n;
+		if (*label)
+		{
+			label++;
+		}
+	}
+	buf[len++] = 0;
+	buf[len++] = 0;
+	buf[len++] = type;
+	buf[len++] = 0;
+	buf[len++] = DNS_CLASS_IN;
+	return len;
+}
+
+/* copies the (possibly compressed) name at pos into out as a dotted string.
+ * Returns the offset just past the name in the message, or -1 if it is
+ * malformed */
+
+static int GetName(unsigned char* msg, int len, int pos, char* out, int outlen)
+{
+	int end = -1, o = 0, hops = 0;
+
+	out[0] = '\0';
+	while (pos < len)
+	{
+		int n = msg[pos];
+		if (!n)
+		{
+			return (end < 0) ? pos + 1 : end;
+		}
+		if ((n & 0xc0) == 0xc0)
+		{
+			if ((pos + 1 >= len) || (++hops > 16))
+			{
+				return -1;
+			}
+			if (end < 0)
+			{
+				end = pos + 2;
+			}
+			pos = ((n & 0x3f) << 8) | msg[pos+1];
+			continue;
+		}
+		if ((n & 0xc0) || (pos + 1 + n > len) || (o + n + 2 > outlen))
+		{
+			return -1;
+		}
+		if (o)
+		{
+			out[o++] = '.';
+		}
+		memcpy(out+o,msg+pos+1,n);
+		o += n;
+		out[o] = '\0';
+		pos += n + 1;
+	}
+	return -1;
+}
+
+/* hostnames end up in nick!ident@host, so only accept sane ones */
+
+static bool ValidHost(char* host)
+{
+	size_t len = strlen(host);
+	size_t label = 0;
+
+	if ((len < 1) || (len > 253) || (host[0] == '.') || (host[0] == '-'))
+	{
+		return false;
+	}
+	for (unsigned char* c = (unsigned char*)host; *c; c++)
+	{
+		if (*c == '.')
+		{
+			label = 0;
+		}
+		else if (((!isalnum(*c)) && (*c != '-')) || (++label > 63))
+		{
+			/* and no label may be longer than 63 characters */
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool SendQuery(struct dnsrec* lookup, char* name, int type)
+{
+	unsigned char buf[512];
+	int len;
+
+	if (resolver < 0)
+	{
+		return false;
+	}
+	/* query ids are all that stop someone forging answers (the kernel
+	 * also picks us a random source port), so they are drawn from
+	 * SipHash of a counter under the secret key InitHashKey() read from
+	 * /dev/urandom at startup, which nobody outside can predict */
+	do
+	{
+		lookup->id = KeyedHash((const unsigned char*)&query_serial,sizeof(query_serial),0) & 0xffff;
+		query_serial++;
+	} while ((!lookup->id) || (queries.find(lookup->id) != queries.end()));
+
+	if ((len = MakeQuery(buf,lookup->id,name,type)) < 0)
+	{
+		return false;
+	}
+	if (sendto(resolver,buf,len,0,(struct sockaddr*)&nameserver,sizeof(nameserver)) != len)
+	{
+		debug("SendQuery: can't send query for %s: %s",name,strerror(errno));
+		return false;
+	}
+	queries[lookup->id] = lookup;
+	AddTimer(&lookup->timeout,time(NULL)+querytimeout,LookupTimeout,lookup);
+	return true;
+}
+
+/* returns the cache entry for ip, or NULL if it isn't cached or has
+ * expired. A hit moves the entry to the front of the LRU list */
+
+static struct hostentry* FindHost(struct in_addr ip)
+{
+	host_cache::iterator i = hosts.find(ip.s_addr);
+
+	if (i == hosts.end())
+	{
+		cache.misses++;
+		return NULL;
+	}
+	if (i->second->expires <= time(NULL))
+	{
+		lru.erase(i->second);
+		hosts.erase(i);
+		cache.size--;
+		cache.misses++;
+		return NULL;
+	}
+	lru.splice(lru.begin(),lru,i->second);
+	cache.hits++;
+	return &lru.front();
+}
+
+/* remembers the result of a lookup which the nameserver answered (or
+ * failed to answer), host is NULL for a failure */
+
+static void CacheHost(struct dnsrec* lookup, char* host)
+{
+	unsigned int ttl = host ? lookup->ttl : NEGATIVE_TTL;
+	host_cache::iterator i = hosts.find(lookup->ip.s_addr);
+
+	if (i != hosts.end())
+	{
+		lru.erase(i->second);
+		hosts.erase(i);
+		cache.size--;
+	}
+	if (!ttl)
+	{
+		return;
+	}
+	while ((cache.size >= cache.max) && (!lru.empty()))
+	{
+		hosts.erase(lru.back().ip);
+		lru.pop_back();
+		cache.size--;
+		cache.evictions++;
+	}
+
+	hostentry h;
+	h.ip = lookup->ip.s_addr;
+	h.expires = time(NULL) + (ttl > MAXIMUM_TTL ? MAXIMUM_TTL : ttl);
+	h.host = host ? host : "";
+	lru.push_front(h);
+	hosts[h.ip] = lru.begin();
+	cache.size++;
+}
+
+void GetCacheStats(struct cachestats* stats)
+{
+	*stats = cache;
+	stats->slots = hosts.slot_count();
+	hosts.probe_stats(stats->probes);
+}
+
+/* ends a lookup and hands the result to its owner. The owner may destroy
+ * the lookup in its handler, so it isn't touched afterwards */
+
+static void FinishLookup(struct dnsrec* lookup, char* host)
+{
+	CancelLookup(lookup);
+	lookup->handler(lookup,host);
+}
+
+void LookupTimeout(struct timerec* timer, time_t now)
+{
+	struct dnsrec* lookup = (struct dnsrec*)timer->data;
+
+	debug("LookupTimeout: no answer for %s",inet_ntoa(lookup->ip));
+	CacheHost(lookup,NULL);
+	FinishLookup(lookup,NULL);
+}
+
+void ReverseLookup(struct dnsrec* lookup, struct in_addr ip, dns_handler handler, void* data)
+{
+	unsigned char* b = (unsigned char*)&ip.s_addr;
+	char name[MAXBUF];
+	struct hostentry* h;
+
+	CancelLookup(lookup);
+	lookup->ip = ip;
+	lookup->host[0] = '\0';
+	lookup->handler = handler;
+	lookup->data = data;
+	lookup->ttl = 0;
+
+	if ((h = FindHost(ip)))
+	{
+		lookup->cached = true;
+		strcpy(lookup->host,h->host.c_str());
+		handler(lookup,*lookup->host ? lookup->host : NULL);
+		return;
+	}
+	lookup->cached = false;
+	lookup->stage = DNS_PTR;
+
+	sprintf(name,"%d.%d.%d.%d.in-addr.arpa",b[3],b[2],b[1],b[0]);
+	if (!SendQuery(lookup,name,DNS_TYPE_PTR))
+	{
+		FinishLookup(lookup,NULL);
+	}
+}
+
+void CancelLookup(struct dnsrec* lookup)
+{
+	if (lookup->stage != DNS_IDLE)
+	{
+		queries.erase(lookup->id);
+		DelTimer(&lookup->timeout);
+		lookup->stage = DNS_IDLE;
+	}
+}
+
+/* deals with one answer. On a PTR answer the name is sent off to be
+ * confirmed, on an A answer the lookup is finished */
+
+static void ProcessAnswer(unsigned char* msg, int len)
+{
+	map<unsigned short, dnsrec*>::iterator q;
+	struct dnsrec* lookup;
+	char name[MAXBUF];
+	int pos, qdcount, ancount, type, rdlength;
+	unsigned int ttl;
+
+	if (len < 12)
+	{
+		return;
+	}
+	q = queries.find((msg[0] << 8) | msg[1]);
+	if ((q == queries.end()) || (!(msg[2] & 0x80)))
+	{
+		/* not ours, or a stale answer to something we gave up on */
+		return;
+	}
+	lookup = q->second;
+	qdcount = (msg[4] << 8) | msg[5];
+	ancount = (msg[6] << 8) | msg[7];
+
+	pos = 12;
+	for (int i = 0; (i < qdcount) && (pos >= 0); i++)
+	{
+		pos = GetName(msg,len,pos,name,MAXBUF);
+		pos = (pos >= 0) ? pos + 4 : -1;
+	}
+
+	/* rcode is non-zero for NXDOMAIN, SERVFAIL and friends */
+	for (int i = 0; (i < ancount) && (pos >= 0) && (!(msg[3] & 0x0f)); i++)
+	{
+		if ((pos = GetName(msg,len,pos,name,MAXBUF)) < 0 || (pos + 10 > len))
+		{
+			break;
+		}
+		type = (msg[pos] << 8) | msg[pos+1];
+		ttl = (msg[pos+4] << 24) | (msg[pos+5] << 16) | (msg[pos+6] << 8) | msg[pos+7];
+		rdlength = (msg[pos+8] << 8) | msg[pos+9];
+		pos += 10;
+		if (pos + rdlength > len)
+		{
+			break;
+		}
+
+		if ((lookup->stage == DNS_PTR) && (type == DNS_TYPE_PTR))
+		{
+			if ((GetName(msg,len,pos,lookup->host,sizeof(lookup->host)) < 0) || (!ValidHost(lookup->host)))
+			{
+				break;
+			}
+			/* now make sure the name really belongs to this address */
+			lookup->ttl = ttl;
+			CancelLookup(lookup);
+			lookup->stage = DNS_A;
+			if (!SendQuery(lookup,lookup->host,DNS_TYPE_A))
+			{
+				FinishLookup(lookup,NULL);
+			}
+			return;
+		}
+		if ((lookup->stage == DNS_A) && (type == DNS_TYPE_A) && (rdlength == 4) && (!memcmp(msg+pos,&lookup->ip.s_addr,4)))
+		{
+			/* the answer is only good for as long as both halves are */
+			lookup->ttl = (ttl < lookup->ttl) ? ttl : lookup->ttl;
+			CacheHost(lookup,lookup->host);
+			FinishLookup(lookup,lookup->host);
+			return;
+		}
+		pos += rdlength;
+	}
+	debug("ProcessAnswer: lookup of %s failed",inet_ntoa(lookup->ip));
+	CacheHost(lookup,NULL);
+	FinishLookup(lookup,NULL);
+}
+
+void ResolverRead(void)
+{
+	unsigned char buf[1024];
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	int len;
+
+	for (;;)
+	{
+		fromlen = sizeof(from);
+		len = recvfrom(resolver,buf,sizeof(buf),0,(struct sockaddr*)&from,&fromlen);
+		if (len < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		if ((from.sin_addr.s_addr != nameserver.sin_addr.s_addr) || (from.sin_port != nameserver.sin_port))
+		{
+			debug("ResolverRead: ignoring packet from %s",inet_ntoa(from.sin_addr));
+			continue;
+		}
+		ProcessAnswer(buf,len);
+	}
+}
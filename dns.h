@@ -0,0 +1,86 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  Inspire is copyright (C) 2002-2003 ChatSpike-Dev.
+ *                       E-mail:
+ *                <brain@chatspike.net>
+ *           	  <Craig@chatspike.net>
+ *
+ * Written by Craig Edwards, Craig McLure, and others.
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "timer.h"
+#include "flathash.h"
+
+#ifndef __DNS_H__
+#define __DNS_H__
+
+/* stages of a lookup */
+
+#define DNS_IDLE	0
+#define DNS_PTR		1	/* waiting for the PTR answer */
+#define DNS_A		2	/* waiting for the A answer which confirms it */
+
+struct dnsrec;
+
+/* called once a lookup has finished, with the confirmed hostname or NULL if
+ * there isn't one (no PTR, no matching A, timeout or error) */
+typedef void (*dns_handler)(struct dnsrec* lookup, char* host);
+
+/* a reverse lookup of one address. Like a timerec this is normally embedded
+ * in whatever it belongs to, and destroying it cancels the lookup */
+
+struct dnsrec {
+	int stage;		/* DNS_IDLE, DNS_PTR or DNS_A */
+	unsigned short id;	/* id of the query on the wire */
+	struct in_addr ip;	/* address being looked up */
+	char host[256];		/* name from the PTR answer, being confirmed */
+	dns_handler handler;
+	void* data;		/* owner of the lookup, for the handler */
+	unsigned int ttl;	/* how long the answer may be cached for */
+	bool cached;		/* true if the answer came from the host cache */
+	struct timerec timeout;	/* gives up on the query if it isn't answered */
+
+	dnsrec();
+	~dnsrec();
+};
+
+/* counters for the host cache, shown in /stats z */
+
+struct cachestats {
+	int size;		/* addresses cached now */
+	int max;		/* most addresses that may be cached */
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;	/* dropped to make room, not expired */
+	int slots;		/* size of the address table */
+	unsigned long probes[FH_PROBEBUCKETS];	/* see flat_hash::probe_stats() */
+};
+
+/* opens the resolver socket, talking to the given server (or the first
+ * nameserver in /etc/resolv.conf if it is empty), and sizes the host
+ * cache. Returns the socket for the socket engine, or -1 if there is no
+ * resolver */
+int ResolverInit(char* server, int port, int timeout, int cachesize);
+
+/* starts a PTR lookup of ip, confirmed by an A lookup of the answer. If
+ * the answer (good or bad) is in the host cache, or the query can't be
+ * sent, the handler is called before this returns */
+void ReverseLookup(struct dnsrec* lookup, struct in_addr ip, dns_handler handler, void* data);
+
+/* abandons a lookup without calling its handler */
+void CancelLookup(struct dnsrec* lookup);
+
+/* reads any answers waiting on the resolver socket */
+void ResolverRead(void);
+
+void GetCacheStats(struct cachestats* stats);
+
+#endif
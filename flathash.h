@@ -0,0 +1,255 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  Inspire is copyright (C) 2002-2003 ChatSpike-Dev.
+ *                       E-mail:
+ *                <brain@chatspike.net>
+ *           	  <Craig@chatspike.net>
+ *
+ * Written by Craig Edwards, Craig McLure, and others.
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include <vector>
+#include <utility>
+#include <stddef.h>
+
+#ifndef __FLATHASH_H__
+#define __FLATHASH_H__
+
+/* flat_hash is the hash table behind the nick, channel and address
+ * registries. Entries live in one array and collisions go to the next
+ * free slot (open addressing), so a lookup reads neighbouring memory
+ * instead of following a chain of separately allocated nodes.
+ *
+ * Each slot has a control byte alongside it: EMPTY, DELETED or, for a
+ * slot in use, seven bits of the key's hash. A probe only calls the key
+ * comparison when those bits match, so most wrong slots are passed over
+ * without touching the key at all.
+ *
+ * Erasing leaves a DELETED marker so that other keys stay reachable, and
+ * never moves anything, so it is safe while iterating. An insert may
+ * rebuild the table, which invalidates every iterator.
+ *
+ * find() takes any key type the hash and comparison functors accept, so
+ * the string tables can be searched with a plain char* */
+
+#define FH_EMPTY	0x80
+#define FH_DELETED	0xFE
+#define FH_MINSLOTS	16
+
+/* probe length histogram buckets reported by probe_stats(): 0, 1, 2-3,
+ * 4-7 and 8 or more slots from where the key hashed to */
+#define FH_PROBEBUCKETS	5
+
+template <class K, class V, class H, class E>
+class flat_hash
+{
+ public:
+	typedef std::pair<K,V> value_type;
+
+	class iterator
+	{
+		flat_hash* table;
+		size_t slot;
+	 public:
+		iterator() : table(NULL), slot(0) { }
+		iterator(flat_hash* t, size_t s) : table(t), slot(s) { }
+		value_type& operator*() const { return table->slots[slot]; }
+		value_type* operator->() const { return &table->slots[slot]; }
+		iterator& operator++() { slot = table->next(slot + 1); return *this; }
+		iterator operator++(int) { iterator i = *this; slot = table->next(slot + 1); return i; }
+		bool operator==(const iterator &i) const { return slot == i.slot; }
+		bool operator!=(const iterator &i) const { return slot != i.slot; }
+		friend class flat_hash;
+	};
+	typedef iterator const_iterator;
+
+	flat_hash() : count(0), used(0)
+	{
+		resize(FH_MINSLOTS);
+	}
+
+	iterator begin() { return iterator(this,next(0)); }
+	iterator end() { return iterator(this,ctrl.size()); }
+	size_t size() const { return count; }
+	size_t slot_count() const { return ctrl.size(); }
+
+	template <class Q> iterator find(const Q &key)
+	{
+		unsigned long long h = mix(hasher(key));
+		unsigned char fp = fingerprint(h);
+
+		for (size_t i = home(h); ; i = (i + 1) & mask)
+		{
+			if (ctrl[i] == FH_EMPTY)
+			{
+				return end();
+			}
+			if ((ctrl[i] == fp) && (equal(slots[i].first,key)))
+			{
+				return iterator(this,i);
+			}
+		}
+	}
+
+	/* the value for key, adding it with a default value if it isn't there */
+	V& operator[](const K &key)
+	{
+		iterator f = find(key);
+
+		if (f != end())
+		{
+			return f->second;
+		}
+		if ((used + 1) * 8 > ctrl.size() * 7)
+		{
+			/* too full of keys or DELETED markers, rebuild */
+			resize(ctrl.size());
+		}
+
+		unsigned long long h = mix(hasher(key));
+		size_t i = home(h);
+
+		while (ctrl[i] < FH_EMPTY)
+		{
+			i = (i + 1) & mask;
+		}
+		if (ctrl[i] == FH_EMPTY)
+		{
+			used++;
+		}
+		ctrl[i] = fingerprint(h);
+		slots[i].first = key;
+		slots[i].second = V();
+		count++;
+		return slots[i].second;
+	}
+
+	void erase(iterator i)
+	{
+		/* a slot followed by an empty one is the end of any probe
+		 * which reaches it, so it can simply be emptied */
+		if (ctrl[(i.slot + 1) & mask] == FH_EMPTY)
+		{
+			ctrl[i.slot] = FH_EMPTY;
+			used--;
+		}
+		else
+		{
+			ctrl[i.slot] = FH_DELETED;
+		}
+		slots[i.slot] = value_type();
+		count--;
+	}
+
+	template <class Q> void erase(const Q &key)
+	{
+		iterator i = find(key);
+
+		if (i != end())
+		{
+			erase(i);
+		}
+	}
+
+	/* fills hist with how far each key is from where it hashed to, in
+	 * FH_PROBEBUCKETS buckets, for /stats z */
+	void probe_stats(unsigned long* hist) const
+	{
+		for (int b = 0; b < FH_PROBEBUCKETS; b++)
+		{
+			hist[b] = 0;
+		}
+		for (size_t i = 0; i < ctrl.size(); i++)
+		{
+			if (ctrl[i] < FH_EMPTY)
+			{
+				size_t d = (i - home(mix(hasher(slots[i].first)))) & mask;
+				int b = 0;
+
+				while ((d) && (b < FH_PROBEBUCKETS - 1))
+				{
+					d >>= 1;
+					b++;
+				}
+				hist[b]++;
+			}
+		}
+	}
+
+ private:
+	std::vector<unsigned char> ctrl;
+	std::vector<value_type> slots;
+	size_t mask;
+	size_t count;	/* keys in the table */
+	size_t used;	/* slots which aren't EMPTY, keys and DELETED markers */
+	H hasher;
+	E equal;
+
+	/* spreads the hash over all the bits, the slot is taken from the top
+	 * half and the fingerprint from just below it */
+	static unsigned long long mix(size_t h)
+	{
+		return (unsigned long long)h * 0x9E3779B97F4A7C15ULL;
+	}
+
+	size_t home(unsigned long long h) const
+	{
+		return (size_t)(h >> 32) & mask;
+	}
+
+	static unsigned char fingerprint(unsigned long long h)
+	{
+		return (h >> 25) & 0x7f;
+	}
+
+	size_t next(size_t i) const
+	{
+		while ((i < ctrl.size()) && (ctrl[i] >= FH_EMPTY))
+		{
+			i++;
+		}
+		return i;
+	}
+
+	/* rebuilds the table with room for what is in it, at least minslots
+	 * slots and never more than 7/16ths full */
+	void resize(size_t minslots)
+	{
+		std::vector<unsigned char> oldctrl;
+		std::vector<value_type> oldslots;
+		size_t n = FH_MINSLOTS;
+
+		while ((n < minslots) || (n * 7 < (count + 1) * 16))
+		{
+			n <<= 1;
+		}
+		oldctrl.swap(ctrl);
+		oldslots.swap(slots);
+		ctrl.assign(n,FH_EMPTY);
+		slots.resize(n);
+		mask = n - 1;
+		used = count;
+		for (size_t i = 0; i < oldctrl.size(); i++)
+		{
+			if (oldctrl[i] < FH_EMPTY)
+			{
+				size_t j = home(mix(hasher(oldslots[i].first)));
+
+				while (ctrl[j] != FH_EMPTY)
+				{
+					j = (j + 1) & mask;
+				}
+				ctrl[j] = oldctrl[i];
+				slots[j] = oldslots[i];
+			}
+		}
+	}
+};
+
+#endif
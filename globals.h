@@ -33,9 +33,17 @@ extern "C" void WriteCommon(struct userrec *u, char* text, ...);
 extern "C" void WriteCommonExcept(struct userrec *u, char* text, ...);
 extern "C" void WriteWallOps(struct userrec *source, char* text, ...);
 extern "C" int isnick(const char *n);
-extern "C" struct userrec* Find(string nick);
+extern "C" struct userrec* Find(const char* nick);
 extern "C" struct chanrec* FindChan(const char* chan);
 extern "C" char* cmode(struct userrec *user, struct chanrec *chan);
+extern "C" int usercount(struct chanrec *c);
+extern "C" int usercnt(void);
+extern "C" int usercount_invisible(void);
+extern "C" int usercount_opers(void);
+extern "C" int usercount_unknown(void);
+extern "C" int usercount_max(void);
+extern "C" int chancount(void);
+extern "C" int servercount(void);
 extern "C" string getservername();
 extern "C" string getnetworkname();
 extern "C" string getadminname();
@@ -0,0 +1,57 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  Inspire is copyright (C) 2002-2003 ChatSpike-Dev.
+ *                       E-mail:
+ *                <brain@chatspike.net>
+ *           	  <Craig@chatspike.net>
+ *
+ * Written by Craig Edwards, Craig McLure, and others.
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include <string>
+#include <string.h>
+#include "siphash.h"
+#include "casemap.h"
+
+#ifndef __HASHCOMP_H__
+#define __HASHCOMP_H__
+
+/* the hash and the comparison used by the nick and channel tables. Both
+ * fold case as they go (see casemap.h), so they always agree on which
+ * names are the same, and nothing is copied. Both also take a plain char*
+ * so a name can be looked up without making a string of it */
+
+struct StrHash
+{
+	/* keyed with a secret picked at startup (see siphash.cpp) so that
+	 * nobody can choose a batch of nicks or channels which all hash
+	 * to the same slot */
+	size_t operator()(const char* s) const
+	{
+		return KeyedHash((const unsigned char*)s,strlen(s),1);
+	}
+	size_t operator()(const std::string &s) const
+	{
+		return KeyedHash((const unsigned char*)s.data(),s.length(),1);
+	}
+};
+
+struct StrHashComp
+{
+	bool operator()(const std::string& s1, const char* s2) const
+	{
+		return (strlen(s2) == s1.length()) && (casefold_eq(s1.data(),s2,s1.length()));
+	}
+	bool operator()(const std::string& s1, const std::string& s2) const
+	{
+		return (s1.length() == s2.length()) && (casefold_eq(s1.data(),s2.data(),s1.length()));
+	}
+};
+
+#endif
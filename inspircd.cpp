@@ -109,17 +109,28 @@
 #include <sys/errno.h>
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <netinet/tcp.h>
 #include <cstdio>
 #include <time.h>
+#include <limits.h>
 #include <string>
-#include <hash_map.h>
 #include <sstream>
 #include <vector>
+#include <algorithm>
 #include "users.h"
+#include "flathash.h"
+#include "siphash.h"
+#include "casemap.h"
+#include "hashcomp.h"
 #include "ctables.h"
 #include "globals.h"
 #include "modules.h"
 #include "dynamic.h"
+#include "socketengine.h"
+#include "timer.h"
+#include "dns.h"
 
 using namespace std;
 
@@ -137,66 +148,20 @@ char list[MAXBUF];
 char PrefixQuit[MAXBUF];
 char DieValue[MAXBUF];
 int debugging = 0;
+int RecvQMax = 8192;
+int SendQMax = 262144;
+int CmdBudget = 5;
+unsigned int MaxChans = MAXCHANS;
+char DNSServer[MAXBUF];
+int DNSPort = 53;
+int DNSTimeout = 5;
+int DNSCacheSize = 4096;
+char SocketEngineName[MAXBUF];
 int MODCOUNT = -1;
 time_t startup_time = time(NULL);
 
-template<> struct hash<in_addr>
-{
-	size_t operator()(const struct in_addr &a) const
-	{
-		size_t q;
-		memcpy(&q,&a,sizeof(size_t));
-		return q;
-	}
-};
-
-template<> struct hash<string>
-{
-	size_t operator()(const string &s) const
-	{
-		char a[MAXBUF];
-		static struct hash<const char *> strhash;
-		strcpy(a,s.c_str());
-		strlower(a);
-		return strhash(a);
-	}
-};
-	
-
-
-struct StrHashComp
-{
-
-	bool operator()(const string& s1, const string& s2) const
-	{
-		char a[MAXBUF],b[MAXBUF];
-		strcpy(a,s1.c_str());
-		strcpy(b,s2.c_str());
-		return (strcasecmp(a,b) == 0);
-	}
-
-};
-
-struct InAddr_HashComp
-{
-
-	bool operator()(const in_addr &s1, const in_addr &s2) const
-	{
-		size_t q;
-		size_t p;
-		
-		memcpy(&q,&s1,sizeof(size_t));
-		memcpy(&p,&s2,sizeof(size_t));
-		
-		return (q == p);
-	}
-
-};
-
-
-typedef hash_map<string, userrec*, hash<string>, StrHashComp> user_hash;
-typedef hash_map<string, chanrec*, hash<string>, StrHashComp> chan_hash;
-typedef hash_map<in_addr,string*, hash<in_addr>, InAddr_HashComp> address_cache;
+typedef flat_hash<string, userrec*, StrHash, StrHashComp> user_hash;
+typedef flat_hash<string, chanrec*, StrHash, StrHashComp> chan_hash;
 typedef vector<command_t> command_table;
 typedef DLLFactory<ModuleFactory> ircd_module;
 typedef vector<string> file_cache;
@@ -206,9 +171,18 @@ chan_hash chanlist;
 command_table cmdlist;
 file_cache MOTD;
 file_cache RULES;
-address_cache IP;
 vector<Module*> modules(255);
 vector<ircd_module*> factory(255);
+SocketEngine* SE = NULL;
+vector<int> flush_list;
+vector<userrec*> fd_ref_table;	/* the user owning each socket, indexed by fd */
+deque<int> run_list;
+vector<userrec*> list_users;	/* users with a LIST still being sent */
+vector<userrec*> umode_users[UMODE_INDEXES];	/* users with each mode in UMODE_INDEXED */
+long registered_users = 0;	/* clients which have finished registering, see ConnectUser() */
+long max_users = 0;		/* most registered_users seen at once */
+struct timerec listen_pause[MAXSOCKS];	/* brings back a listener taken out when fds ran out */
+unsigned long epoch = 0;	/* stamps users and channels already visited, see SendCommon() */
 
 struct linger linger = { 0 };
 char bannerBuffer[MAXBUF];
@@ -217,8 +191,27 @@ int boundPortCount = 0;
 /* prototypes */
 
 int has_channel(struct userrec *u, struct chanrec *c);
-int usercount(struct chanrec *c);
-void update_stats_l(int fd,int data_out);
+struct ucrec* find_ucrec(struct userrec *u, struct chanrec *c);
+void join_member(struct userrec *user, struct ucrec *uc);
+void part_member(struct userrec *user, struct ucrec *uc);
+void names_invalidate(struct chanrec *c);
+void free_channel(struct chanrec *c);
+void part_all(struct userrec *user);
+void end_list(struct userrec *user);
+int set_umode(struct userrec *user, char mode, int adding);
+void clear_umodes(struct userrec *user);
+void count_user(int adding);
+void handle_lusers(char **parameters, int pcnt, struct userrec *user);
+int list_turn(struct userrec *user);
+void AddSendQ(int fd,char* data,int len);
+void QueueLine(struct userrec *user, const sendline &line);
+int FlushClient(struct userrec *user);
+int SendQIovec(struct userrec *user, struct iovec* iov, int max);
+void SendQConsume(struct userrec *user, int count);
+void PingTimer(struct timerec* timer, time_t now);
+void RegTimer(struct timerec* timer, time_t now);
+void ListenTimer(struct timerec* timer, time_t now);
+void ConnectUser(struct userrec *user);
 
 /* chop a string down to 512 characters and preserve linefeed (irc max
  * line length) */
@@ -318,7 +311,7 @@ void readfile(file_cache &F, char* fname)
 
 void ReadConfig(void)
 {
-  char dbg[MAXBUF];
+  char dbg[MAXBUF],rq[MAXBUF],sq[MAXBUF],cb[MAXBUF],mc[MAXBUF],dnsport[MAXBUF],dnstimeout[MAXBUF],dnscache[MAXBUF];
   ConfValue("server","name",0,ServerName);
   ConfValue("server","description",0,ServerDesc);
   ConfValue("server","network",0,Network);
@@ -337,6 +330,40 @@ void ReadConfig(void)
   {
 	  debugging = 1;
   }
+  strcpy(rq,"");
+  ConfValue("options","recvq",0,rq);
+  RecvQMax = atoi(rq);
+  if (RecvQMax < MAXBUF)
+  {
+	  /* must hold at least one full line */
+	  RecvQMax = 8192;
+  }
+  strcpy(sq,"");
+  ConfValue("options","sendq",0,sq);
+  SendQMax = atoi(sq);
+  if (SendQMax < MAXBUF)
+  {
+	  SendQMax = 262144;
+  }
+  strcpy(cb,"");
+  ConfValue("options","cmdbudget",0,cb);
+  CmdBudget = atoi(cb) > 0 ? atoi(cb) : 5;
+  strcpy(mc,"");
+  ConfValue("options","maxchans",0,mc);
+  MaxChans = atoi(mc) > 0 ? atoi(mc) : MAXCHANS;
+  strcpy(SocketEngineName,"");
+  ConfValue("options","socketengine",0,SocketEngineName);
+  strcpy(DNSServer,"");
+  strcpy(dnsport,"");
+  strcpy(dnstimeout,"");
+  strcpy(dnscache,"");
+  ConfValue("dns","server",0,DNSServer);
+  ConfValue("dns","port",0,dnsport);
+  ConfValue("dns","timeout",0,dnstimeout);
+  ConfValue("dns","cachesize",0,dnscache);
+  DNSPort = atoi(dnsport) > 0 ? atoi(dnsport) : 53;
+  DNSTimeout = atoi(dnstimeout) > 0 ? atoi(dnstimeout) : 5;
+  DNSCacheSize = atoi(dnscache) > 0 ? atoi(dnscache) : 4096;
   readfile(MOTD,motd);
   readfile(RULES,rules);
 }
@@ -358,24 +385,6 @@ void NonBlocking(int s)
 }
 
 
-int CleanAndResolve (char *resolvedHost, const char *unresolvedHost)
-{
-  struct hostent *hostPtr = NULL;
-  struct in_addr addr;
-
-  memset (resolvedHost, '\0',MAXBUF);
-  if(unresolvedHost == NULL)
-	return(ERROR);
-  if ((inet_aton(unresolvedHost,&addr)) == 0)
-	return(ERROR);
-  hostPtr = gethostbyaddr ((char *)&addr.s_addr,sizeof(addr.s_addr),AF_INET);
-  if (hostPtr != NULL)
-  	snprintf(resolvedHost,MAXBUF,"%s",hostPtr->h_name);
-  else
-  	snprintf(resolvedHost,MAXBUF,"%s",unresolvedHost);
-  return (TRUE);
-}
-
 /* write formatted text to a socket, in same format as printf */
 
 extern "C" void Write(int sock,char *text, ...)
@@ -393,8 +402,7 @@ extern "C" void Write(int sock,char *text, ...)
   va_end(argsPtr);
   sprintf(tb,"%s\r\n",textbuffer);
   chop(tb);
-  write(sock,tb,strlen(tb));
-  update_stats_l(sock,strlen(tb)); /* add one line-out to stats L for this fd */
+  AddSendQ(sock,tb,strlen(tb));
 }
 
 /* write a server formatted numeric response to a single socket */
@@ -414,8 +422,25 @@ extern "C" void WriteServ(int sock, char* text, ...)
   sprintf(tb,":%s %s\r\n",ServerName,textbuffer);
   chop(tb);
   debug("WriteServ: %d %s",sock,tb);
-  write(sock,tb,strlen(tb));
-  update_stats_l(sock,strlen(tb)); /* add one line-out to stats L for this fd */
+  AddSendQ(sock,tb,strlen(tb));
+}
+
+/* formats a line from a user into tb, which must hold MAXBUF bytes, and
+ * returns its length */
+
+int FormatFrom(char* tb, struct userrec *user, char* text)
+{
+	int len = snprintf(tb,MAXBUF,":%s!%s@%s %s\r\n",user->nick,user->ident,user->dhost,text);
+
+	if (len > 512)
+	{
+		/* irc lines are limited to 512 bytes including the CR/LF */
+		tb[510] = '\r';
+		tb[511] = '\n';
+		tb[512] = '\0';
+		len = 512;
+	}
+	return len;
 }
 
 /* write text from an originating user to originating user */
@@ -423,6 +448,7 @@ extern "C" void WriteServ(int sock, char* text, ...)
 extern "C" void WriteFrom(int sock, struct userrec *user,char* text, ...)
 {
   char textbuffer[MAXBUF],tb[MAXBUF];
+  int len;
   va_list argsPtr;
   va_start (argsPtr, text);
 
@@ -432,11 +458,9 @@ extern "C" void WriteFrom(int sock, struct userrec *user,char* text, ...)
   }
   vsnprintf(textbuffer, MAXBUF, text, argsPtr);
   va_end(argsPtr);
-  sprintf(tb,":%s!%s@%s %s\r\n",user->nick,user->ident,user->dhost,textbuffer);
-  chop(tb);
+  len = FormatFrom(tb,user,textbuffer);
   debug("WriteFrom: %d %s",sock,tb);
-  write(sock,tb,strlen(tb));
-  update_stats_l(sock,strlen(tb)); /* add one line-out to stats L for this fd */
+  AddSendQ(sock,tb,len);
 }
 
 /* write text to an destination user from a source user (e.g. user privmsg) */
@@ -461,16 +485,21 @@ extern "C" void WriteTo(struct userrec *source, struct userrec *dest,char *data,
 
 extern "C" void WriteChannel(struct chanrec* Ptr, struct userrec* user, char* text, ...)
 {
-	char textbuffer[MAXBUF];
+	char textbuffer[MAXBUF],tb[MAXBUF];
 	va_list argsPtr;
 	va_start (argsPtr, text);
 	vsnprintf(textbuffer, MAXBUF, text, argsPtr);
 	va_end(argsPtr);
-	for (user_hash::const_iterator i = clientlist.begin(); i != clientlist.end(); i++)
+	/* the line is the same for everyone, so it is only built once */
+	int len = FormatFrom(tb,user,textbuffer);
+	sendline line(tb,len);
+	for (unsigned int i = 0; i < Ptr->members.size(); i++)
 	{
-		if (has_channel(i->second,Ptr) && (i->second->fd != 0))
+		userrec* dest = Ptr->members[i]->user;
+
+		if (dest->fd != 0)
 		{
-			WriteTo(user,i->second,"%s",textbuffer);
+			QueueLine(dest,line);
 		}
 	}
 }
@@ -480,17 +509,21 @@ extern "C" void WriteChannel(struct chanrec* Ptr, struct userrec* user, char* te
 
 extern "C" void ChanExceptSender(struct chanrec* Ptr, struct userrec* user, char* text, ...)
 {
-	char textbuffer[MAXBUF];
+	char textbuffer[MAXBUF],tb[MAXBUF];
 	va_list argsPtr;
 	va_start (argsPtr, text);
 	vsnprintf(textbuffer, MAXBUF, text, argsPtr);
 	va_end(argsPtr);
 
-	for (user_hash::const_iterator i = clientlist.begin(); i != clientlist.end(); i++)
+	int len = FormatFrom(tb,user,textbuffer);
+	sendline line(tb,len);
+	for (unsigned int i = 0; i < Ptr->members.size(); i++)
 	{
-		if (has_channel(i->second,Ptr) && (i->second->fd != 0) && (user != i->second))
+		userrec* dest = Ptr->members[i]->user;
+
+		if ((dest->fd != 0) && (user != dest))
 		{
-			WriteTo(user,i->second,"%s",textbuffer);
+			QueueLine(dest,line);
 		}
 	}
 }
@@ -500,24 +533,56 @@ extern "C" void ChanExceptSender(struct chanrec* Ptr, struct userrec* user, char
 
 extern "C" int common_channels(struct userrec *u, struct userrec *u2)
 {
-	int i = 0;
-	int z = 0;
+	unsigned int i = 0;
 
-	if ((!u) || (!u2))
+	if ((!u) || (!u2) || (u->registered != 7) || (u2->registered != 7))
 	{
 		return 0;
 	}
-	for (i = 0; i <= MAXCHANS; i++)
+	/* mark u's channels, then look for a mark among u2's */
+	epoch++;
+	for (i = 0; i < u->chans.size(); i++)
+	{
+		u->chans[i]->channel->epoch = epoch;
+	}
+	for (i = 0; i < u2->chans.size(); i++)
+	{
+		if (u2->chans[i]->channel->epoch == epoch)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* queues a line to everyone who shares a channel with u, other than u.
+ * Only u's channels are visited, and each recipient is stamped with a new
+ * epoch when it is sent the line, so someone on several of the channels
+ * gets it only once */
+
+void SendCommon(struct userrec *u, const sendline &line)
+{
+	if (u->registered != 7)
+	{
+		return;
+	}
+	epoch++;
+	u->epoch = epoch;
+	for (unsigned int i = 0; i < u->chans.size(); i++)
 	{
-		for (z = 0; z <= MAXCHANS; z++)
+		struct chanrec* c = u->chans[i]->channel;
+
+		for (unsigned int j = 0; j < c->members.size(); j++)
 		{
-			if ((u->chans[i].channel == u2->chans[z].channel) && (u->chans[i].channel) && (u2->chans[z].channel) && (u->registered == 7) && (u2->registered == 7))
+			userrec* dest = c->members[j]->user;
+
+			if ((dest->epoch != epoch) && (dest->fd) && (dest->registered == 7))
 			{
-				return 1;
+				dest->epoch = epoch;
+				QueueLine(dest,line);
 			}
 		}
 	}
-	return 0;
 }
 
 /* write a formatted string to all users who share at least one common
@@ -525,21 +590,19 @@ extern "C" int common_channels(struct userrec *u, struct userrec *u2)
 
 extern "C" void WriteCommon(struct userrec *u, char* text, ...)
 {
-	char textbuffer[MAXBUF];
+	char textbuffer[MAXBUF],tb[MAXBUF];
 	va_list argsPtr;
 	va_start (argsPtr, text);
 	vsnprintf(textbuffer, MAXBUF, text, argsPtr);
 	va_end(argsPtr);
 
-	WriteFrom(u->fd,u,"%s",textbuffer);
-
-	for (user_hash::const_iterator i = clientlist.begin(); i != clientlist.end(); i++)
+	int len = FormatFrom(tb,u,textbuffer);
+	sendline line(tb,len);
+	if (u->fd)
 	{
-		if (common_channels(u,i->second) && (i->second->fd) && (i->second != u))
-		{
-			WriteFrom(i->second->fd,u,"%s",textbuffer);
-		}
+		QueueLine(u,line);
 	}
+	SendCommon(u,line);
 }
 
 /* write a formatted string to all users who share at least one common
@@ -547,19 +610,84 @@ extern "C" void WriteCommon(struct userrec *u, char* text, ...)
 
 extern "C" void WriteCommonExcept(struct userrec *u, char* text, ...)
 {
-	char textbuffer[MAXBUF];
+	char textbuffer[MAXBUF],tb[MAXBUF];
 	va_list argsPtr;
 	va_start (argsPtr, text);
 	vsnprintf(textbuffer, MAXBUF, text, argsPtr);
 	va_end(argsPtr);
 
-	for (user_hash::const_iterator i = clientlist.begin(); i != clientlist.end(); i++)
+	int len = FormatFrom(tb,u,textbuffer);
+	sendline line(tb,len);
+	SendCommon(u,line);
+}
+
+/* where a user mode's list is in umode_users, or -1 if it has none */
+
+int umode_index(char mode)
+{
+	const char* p = strchr(UMODE_INDEXED,mode);
+
+	if ((!p) || (!mode))
+	{
+		return -1;
+	}
+	return p - UMODE_INDEXED;
+}
+
+/* gives a user a mode or takes it away, keeping the lists of users who
+ * hold the modes in UMODE_INDEXED up to date. A user leaving a list has
+ * the last one in it take their place. Returns false if the user already
+ * had (or didn't have) the mode */
+
+int set_umode(struct userrec *user, char mode, int adding)
+{
+	char* p = strchr(user->modes,mode);
+	int n = umode_index(mode);
+
+	if (adding)
 	{
-		if ((common_channels(u,i->second)) && (u != i->second))
+		size_t len = strlen(user->modes);
+
+		if ((p) || (len >= sizeof(user->modes) - 1))
+		{
+			return 0;
+		}
+		user->modes[len] = mode;
+		user->modes[len+1] = '\0';
+		if (n >= 0)
+		{
+			user->umode_pos[n] = umode_users[n].size();
+			umode_users[n].push_back(user);
+		}
+	}
+	else
+	{
+		if ((!p) || (!mode))
+		{
+			return 0;
+		}
+		memmove(p,p+1,strlen(p));
+		if (n >= 0)
 		{
-			WriteFrom(i->second->fd,u,"%s",textbuffer);
+			vector<userrec*> &l = umode_users[n];
+
+			l[user->umode_pos[n]] = l.back();
+			l[user->umode_pos[n]]->umode_pos[n] = user->umode_pos[n];
+			l.pop_back();
 		}
 	}
+	return 1;
+}
+
+/* takes away all of a user's modes, called as they leave */
+
+void clear_umodes(struct userrec *user)
+{
+	for (const char* m = UMODE_INDEXED; *m; m++)
+	{
+		set_umode(user,*m,0);
+	}
+	user->modes[0] = '\0';
 }
 
 extern "C" void WriteOpers(char* text, ...)
@@ -570,12 +698,11 @@ extern "C" void WriteOpers(char* text, ...)
 	vsnprintf(textbuffer, MAXBUF, text, argsPtr);
 	va_end(argsPtr);
 
-	for (user_hash::const_iterator i = clientlist.begin(); i != clientlist.end(); i++)
+	vector<userrec*> &opers = umode_users[umode_index('o')];
+
+	for (unsigned int i = 0; i < opers.size(); i++)
 	{
-		if ((i->second->fd) && (strstr(i->second->modes,"o")))
-		{
-			WriteServ(i->second->fd,"NOTICE %s :%s",i->second->nick,textbuffer);
-		}
+		WriteServ(opers[i]->fd,"NOTICE %s :%s",opers[i]->nick,textbuffer);
 	}
 }
 
@@ -588,12 +715,11 @@ extern "C" void WriteWallOps(struct userrec *source, char* text, ...)
         vsnprintf(textbuffer, MAXBUF, text, argsPtr);  
         va_end(argsPtr);  
   
-  	for (user_hash::const_iterator i = clientlist.begin(); i != clientlist.end(); i++)
-        {  
-                if ((i->second->fd) && (strstr(i->second->modes,"w")))  
-                {  
-			WriteTo(source,i->second,"WALLOPS %s",textbuffer);
-                }
+	vector<userrec*> &wallops = umode_users[umode_index('w')];
+
+	for (unsigned int i = 0; i < wallops.size(); i++)
+	{
+		WriteTo(source,wallops[i],"WALLOPS %s",textbuffer);
 	}
 }  
 
@@ -609,64 +735,199 @@ extern "C" void WriteWallOps(struct userrec *source, char* text, ...)
 
 void strlower(char *n)
 {
-	int i = 0;
 	if (!n)
 	{
 		return;
 	}
-	for (i = 0; i <= strlen(n); i++)
-	{
-		n[i] = tolower(n[i]);
-		if (n[i] == '[')
-			n[i] = '{';
-		if (n[i] == ']')
-			n[i] = '}';
-		if (n[i] == '\\')
-			n[i] = '|';
-	}
+	casefold(n,n,strlen(n));
 }
 
-/* verify that a user's nickname is valid */
+/* what each character may be used for, see isnick() and ischan(). A nick
+ * is 33-125 except for <>,./?:;@'~#=+()*&%$ and the pound sign, and can't
+ * start with a digit. A channel name can hold anything but NUL, BEL, CR,
+ * LF, space and comma */
+
+#define CC_NICKFIRST	1	/* may start a nick */
+#define CC_NICK		2	/* may appear in a nick after the first character */
+#define CC_CHAN		4	/* may appear in a channel name */
+
+static const unsigned char charclass[256] = {
+	0, 4, 4, 4, 4, 4, 4, 0, 4, 4, 0, 4, 4, 0, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	0, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 0, 7, 4, 4,
+	6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 4, 4, 4, 4, 4, 4,
+	4, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
+};
+
+/* verify that a user's nickname is valid. Users keep the answer for
+ * their own nick in validnick, so there is no need to call this on
+ * u->nick */
 
 extern "C" int isnick(const char* n)
 {
-	int i = 0;
-	char v[MAXBUF];
-	if (!n)
+	const unsigned char* p = (const unsigned char*)n;
+
+	if ((!n) || (!(charclass[*p] & CC_NICKFIRST)))
 	{
 		return 0;
 	}
-	if (!strcmp(n,""))
+	for (p++; charclass[*p] & CC_NICK; p++)
 	{
-		return 0;
+		if (p - (const unsigned char*)n >= NICKMAX-1)
+		{
+			return 0;
+		}
 	}
-	if (strlen(n) > NICKMAX-1)
+	return *p == '\0';
+}
+
+/* verify that a channel name is valid, it must start with # */
+
+int ischan(const char* n)
+{
+	const unsigned char* p = (const unsigned char*)n;
+
+	if ((!n) || (*p != '#'))
 	{
 		return 0;
 	}
-	for (i = 0; i <= strlen(n)-1; i++)
+	for (p++; charclass[*p] & CC_CHAN; p++);
+	return *p == '\0';
+}
+
+/* compares str against a wildcard mask where * matches any run of
+ * characters and ? any single one, ignoring case. Returns true on a match */
+
+int match(const char* str, const char* mask)
+{
+	const char* cp = NULL;
+	const char* mp = NULL;
+
+	while ((*str) && (*mask != '*'))
 	{
-		if ((n[i] < 33) || (n[i] > 125))
+		if ((*mask != '?') && (tolower((unsigned char)*mask) != tolower((unsigned char)*str)))
 		{
 			return 0;
 		}
-		/* can't occur ANYWHERE in a nickname! */
-		if (strchr("<>,./?:;@'~#=+()*&%$ \"!",n[i]) != NULL)
+		mask++;
+		str++;
+	}
+	while (*str)
+	{
+		if (*mask == '*')
+		{
+			if (!*++mask)
+			{
+				return 1;
+			}
+			mp = mask;
+			cp = str + 1;
+		}
+		else if ((*mask == '?') || (tolower((unsigned char)*mask) == tolower((unsigned char)*str)))
 		{
-			return 0;
+			mask++;
+			str++;
 		}
-		/* can't occur as the first char of a nickname... */
-		if ((strchr("0123456789",n[i]) != NULL) && (i == 0))
+		else
 		{
-			return 0;
+			mask = mp;
+			str = cp++;
 		}
 	}
-	return 1;
+	while (*mask == '*')
+	{
+		mask++;
+	}
+	return !*mask;
+}
+
+/* a wildcard mask made ready for matching against many strings. Masks of
+ * the usual forms text, text*, *text and *text* are recognised once, so
+ * that each string then costs one comparison, anything else goes through
+ * match() */
+
+#define MASK_ALL	0	/* "*", matches anything */
+#define MASK_EXACT	1	/* no wildcards at all */
+#define MASK_PREFIX	2	/* text* */
+#define MASK_SUFFIX	3	/* *text */
+#define MASK_CONTAINS	4	/* *text* */
+#define MASK_WILD	5	/* anything else */
+
+struct wildmask {
+	int type;
+	string text;	/* the mask with the leading and trailing * taken off */
+	string mask;	/* the whole mask, for MASK_WILD */
+};
+
+void compile_mask(struct wildmask *m, const char* mask)
+{
+	size_t len = strlen(mask);
+	size_t lead = (len > 0) && (mask[0] == '*');
+	size_t trail = (len > lead) && (mask[len-1] == '*');
+
+	m->mask = mask;
+	m->text.assign(mask + lead, len - lead - trail);
+	if (strspn(mask,"*") == len)
+	{
+		m->type = MASK_ALL;
+	}
+	else if (strpbrk(m->text.c_str(),"*?"))
+	{
+		m->type = MASK_WILD;
+	}
+	else if ((lead) && (trail))
+	{
+		m->type = MASK_CONTAINS;
+	}
+	else if (lead)
+	{
+		m->type = MASK_SUFFIX;
+	}
+	else if (trail)
+	{
+		m->type = MASK_PREFIX;
+	}
+	else
+	{
+		m->type = MASK_EXACT;
+	}
+}
+
+int match_mask(const char* str, struct wildmask *m)
+{
+	long len;
+
+	switch (m->type)
+	{
+		case MASK_ALL:
+			return 1;
+		case MASK_EXACT:
+			return !strcasecmp(str,m->text.c_str());
+		case MASK_PREFIX:
+			return !strncasecmp(str,m->text.c_str(),m->text.length());
+		case MASK_SUFFIX:
+			len = (long)strlen(str) - (long)m->text.length();
+			return (len >= 0) && (!strcasecmp(str + len,m->text.c_str()));
+		case MASK_CONTAINS:
+			return strcasestr(str,m->text.c_str()) != NULL;
+	}
+	return match(str,m->mask.c_str());
 }
 
 /* Find a user record by nickname and return a pointer to it */
 
-extern "C" struct userrec* Find(string nick)
+extern "C" struct userrec* Find(const char* nick)
 {
 	user_hash::iterator iter = clientlist.find(nick);
 
@@ -677,16 +938,46 @@ extern "C" struct userrec* Find(string nick)
 	return iter->second;
 }
 
-void update_stats_l(int fd,int data_out) /* add one line-out to stats L for this fd */
+/* find the user record which owns a socket, returns NULL if none does */
+
+struct userrec* fd_to_user(int fd)
 {
-	for (user_hash::const_iterator i = clientlist.begin(); i != clientlist.end(); i++)
+	if ((fd <= 0) || ((unsigned int)fd >= fd_ref_table.size()))
 	{
-		if ((i->second->fd == fd) && (i->second->fd != 0))
-		{
-			i->second->bytes_out += data_out;
-			i->second->cmds_out++;
-		}
+		return NULL;
+	}
+	return fd_ref_table[fd];
+}
+
+/* queues a line for a socket, it is written out later by FlushWrites() or
+ * when the socket next becomes writeable. Also counts the line-out for
+ * stats L */
+
+void AddSendQ(int fd,char* data,int len)
+{
+	userrec* user = fd_to_user(fd);
+
+	if (!user)
+	{
+		/* not a client socket, nothing to queue it against */
+		write(fd,data,len);
+		return;
 	}
+	QueueLine(user,sendline(data,len));
+}
+
+/* queues a line which may also be queued to other users */
+
+void QueueLine(struct userrec *user, const sendline &line)
+{
+	if (user->sendq.empty())
+	{
+		flush_list.push_back(user->fd);
+	}
+	user->sendq.push_back(line);
+	user->sendqlen += line.length();
+	user->bytes_out += line.length();
+	user->cmds_out++;
 }
 
 
@@ -704,61 +995,30 @@ extern "C" struct chanrec* FindChan(const char* chan)
 }
 
 
-void purge_empty_chans(void)
-{
-	int go_again = 1, purge = 0;
-	
-	while (go_again)
-	{
-		go_again = 0;
-		for (chan_hash::iterator i = chanlist.begin(); i != chanlist.end(); i++)
-		{
-			if (i->second) {
-				if (!usercount(i->second))
-				{
-					/* kill the record */
-					if (i != chanlist.end())
-					{
-						debug("del_channel: destroyed: %s",i->second->name);
-						delete i->second;
-						chanlist.erase(i);
-						go_again = 1;
-						purge++;
-						break;
-					}
-				}
-			}
-		}
-	}
-	debug("completed channel purge, killed %d",purge);
-}
-
 /* returns the status character for a given user on a channel, e.g. @ for op,
  * % for halfop etc. If the user has several modes set, the highest mode
  * the user has must be returned. */
 
 extern "C" char* cmode(struct userrec *user, struct chanrec *chan)
 {
-	int i;
-	for (i = 0; i <= MAXCHANS; i++)
+	struct ucrec* uc = find_ucrec(user,chan);
+
+	if (uc)
 	{
-		if ((user->chans[i].channel == chan) && (chan != NULL))
+		if ((uc->uc_modes & UCMODE_OP) > 0)
 		{
-			if ((user->chans[i].uc_modes & UCMODE_OP) > 0)
-			{
-				return "@";
-			}
-			if ((user->chans[i].uc_modes & UCMODE_HOP) > 0)
-			{
-				return "%";
-			}
-			if ((user->chans[i].uc_modes & UCMODE_VOICE) > 0)
-			{
-				return "+";
-			}
-			return "";
+			return "@";
+		}
+		if ((uc->uc_modes & UCMODE_HOP) > 0)
+		{
+			return "%";
+		}
+		if ((uc->uc_modes & UCMODE_VOICE) > 0)
+		{
+			return "+";
 		}
 	}
+	return "";
 }
 
 char scratch[MAXMODES];
@@ -819,81 +1079,90 @@ char* chanmodes(struct chanrec *chan)
 
 int cstatus(struct userrec *user, struct chanrec *chan)
 {
-	int i;
-	for (i = 0; i <= MAXCHANS; i++)
+	struct ucrec* uc = find_ucrec(user,chan);
+
+	if (uc)
 	{
-		if ((user->chans[i].channel == chan) && (chan != NULL))
+		if ((uc->uc_modes & UCMODE_OP) > 0)
 		{
-			if ((user->chans[i].uc_modes & UCMODE_OP) > 0)
-			{
-				return STATUS_OP;
-			}
-			if ((user->chans[i].uc_modes & UCMODE_HOP) > 0)
-			{
-				return STATUS_HOP;
-			}
-			if ((user->chans[i].uc_modes & UCMODE_VOICE) > 0)
-			{
-				return STATUS_VOICE;
-			}
-			return STATUS_NORMAL;
+			return STATUS_OP;
+		}
+		if ((uc->uc_modes & UCMODE_HOP) > 0)
+		{
+			return STATUS_HOP;
+		}
+		if ((uc->uc_modes & UCMODE_VOICE) > 0)
+		{
+			return STATUS_VOICE;
 		}
 	}
+	return STATUS_NORMAL;
 }
 
 
-/* compile a userlist of a channel into a string, each nick seperated by
- * spaces and op, voice etc status shown as @ and + */
+/* appends one user's "@nick " entry to a channel's cached NAMES reply,
+ * starting a new 353 fragment when the current one is full. A fragment is
+ * sized so that the line still fits with the longest possible nick of the
+ * user who asked for it */
 
-void userlist(struct userrec *user,struct chanrec *c)
+void names_add(struct chanrec *c, struct userrec *u)
 {
-	sprintf(list,"353 %s = %s :", user->nick, c->name);
-  	for (user_hash::const_iterator i = clientlist.begin(); i != clientlist.end(); i++)
+	if ((u->fd == 0) || (!u->validnick))
 	{
-		if (has_channel(i->second,c) && (i->second->fd != 0))
-		{
-			if (isnick(i->second->nick))
-			{
-				strcat(list,cmode(i->second,c));
-				strcat(list,i->second->nick);
-				strcat(list," ");
-				if (strlen(list)>(480-NICKMAX))
-				{
-					/* list overflowed into
-					 * multiple numerics */
-					WriteServ(user->fd,list);
-					sprintf(list,"353 %s = %s :", user->nick, c->name);
-				}
-			}
-		}
+		return;
+	}
+	unsigned int limit = 480 - strlen(ServerName) - NICKMAX - strlen(c->name) - 9;
+	std::string entry = std::string(cmode(u,c)) + u->nick + " ";
+
+	if ((c->names.empty()) || (c->names.back().length() + entry.length() > limit))
+	{
+		c->names.push_back(entry);
 	}
-	/* if whats left in the list isnt empty, send it */
-	if (strcmp(list,""))
+	else
 	{
-		WriteServ(user->fd,list);
+		c->names.back() += entry;
 	}
 }
 
-/* return a count of the users on a specific channel */
+/* drops a channel's cached NAMES reply, it is rebuilt by the next
+ * userlist() call. Called whenever a member leaves, changes nick or has
+ * their status changed */
 
-int usercount(struct chanrec *c)
+void names_invalidate(struct chanrec *c)
 {
-	int i = 0;
-	int count = 0;
+	c->names_valid = false;
+	c->names.clear();
+}
 
-	strcpy(list,"");
-  	for (user_hash::const_iterator i = clientlist.begin(); i != clientlist.end(); i++)
+/* sends the userlist of a channel, each nick seperated by spaces and op,
+ * voice etc status shown as @ and +. The reply is kept rendered in the
+ * channel and only rebuilt after it was invalidated, so a join into a big
+ * channel costs nothing more than copying out the fragments */
+
+void userlist(struct userrec *user,struct chanrec *c)
+{
+	if (!c->names_valid)
 	{
-		if (has_channel(i->second,c) && (i->second->fd != 0))
+		c->names.clear();
+		for (unsigned int i = 0; i < c->members.size(); i++)
 		{
-			if (isnick(i->second->nick))
-			{
-				count++;
-			}
+			names_add(c,c->members[i]->user);
 		}
+		c->names_valid = true;
 	}
-	debug("usercount: %s %d",c->name,count);
-	return count;
+	for (unsigned int i = 0; i < c->names.size(); i++)
+	{
+		WriteServ(user->fd,"353 %s = %s :%s", user->nick, c->name, c->names[i].c_str());
+	}
+}
+
+/* return a count of the users on a specific channel. The member list is
+ * kept up to date on join, part, kick and quit, and a channel is destroyed
+ * as soon as it is empty, so there is nothing to count */
+
+extern "C" int usercount(struct chanrec *c)
+{
+	return c->members.size();
 }
 
 /* add a channel to a user, creating the record for it if needed and linking
@@ -901,7 +1170,6 @@ int usercount(struct chanrec *c)
 
 struct chanrec* add_channel(struct userrec *user, char* cname, char* key)
 {
-	int i = 0;
 	struct chanrec* Ptr;
 	int created = 0;
 
@@ -920,13 +1188,20 @@ struct chanrec* add_channel(struct userrec *user, char* cname, char* key)
 	{
 		return NULL; // already on the channel!
 	}
+
+	if (user->chans.size() >= MaxChans)
+	{
+		debug("add_channel: user channel max exceeded: %s %s",user->nick,cname);
+		WriteServ(user->fd,"405 %s %s :You are on too many channels",user->nick, cname);
+		return NULL;
+	}
 	
 	if (!FindChan(cname))
 	{
 		/* create a new one */
 		debug("add_channel: creating: %s",cname);
 		{
-			chanlist[cname] = new chanrec;
+			chanlist[cname] = new chanrec();
 
 			strcpy(chanlist[cname]->name, cname);
 			chanlist[cname]->topiclock = 1;
@@ -958,38 +1233,31 @@ struct chanrec* add_channel(struct userrec *user, char* cname, char* key)
 		created = 1;
 	}
 
-	
-	for (i =0; i <= MAXCHANS; i++)
+	struct ucrec* uc = new ucrec();
+
+	if (created == 2) 
 	{
-		if (user->chans[i].channel == NULL)
-		{
-			if (created == 2) 
-			{
-				/* first user in is given ops */
-				user->chans[i].uc_modes = UCMODE_OP;
-			}
-			else
-			{
-				user->chans[i].uc_modes = 0;
-			}
-			user->chans[i].channel = Ptr;
-			WriteChannel(Ptr,user,"JOIN :%s",Ptr->name);
-			if (Ptr->topicset)
-			{
-				WriteServ(user->fd,"332 %s %s :%s", user->nick, Ptr->name, Ptr->topic);
-				WriteServ(user->fd,"333 %s %s %s %d", user->nick, Ptr->name, Ptr->setby, Ptr->topicset);
-			}
-			userlist(user,Ptr);
-			WriteServ(user->fd,"366 %s %s :End of /NAMES list.", user->nick, Ptr->name);
-			WriteServ(user->fd,"324 %s %s +%s",user->nick, Ptr->name,chanmodes(Ptr));
-			WriteServ(user->fd,"329 %s %s %d", user->nick, Ptr->name, Ptr->created);
-			FOREACH_MOD OnUserJoin(user,Ptr);
-			return Ptr;
-		}
+		/* first user in is given ops */
+		uc->uc_modes = UCMODE_OP;
 	}
-	debug("add_channel: user channel max exceeded: %s %s",user->nick,cname);
-	WriteServ(user->fd,"405 %s %s :You are on too many channels",user->nick, cname);
-	return NULL;
+	else
+	{
+		uc->uc_modes = 0;
+	}
+	uc->channel = Ptr;
+	join_member(user,uc);
+	WriteChannel(Ptr,user,"JOIN :%s",Ptr->name);
+	if (Ptr->topicset)
+	{
+		WriteServ(user->fd,"332 %s %s :%s", user->nick, Ptr->name, Ptr->topic);
+		WriteServ(user->fd,"333 %s %s %s %d", user->nick, Ptr->name, Ptr->setby, Ptr->topicset);
+	}
+	userlist(user,Ptr);
+	WriteServ(user->fd,"366 %s %s :End of /NAMES list.", user->nick, Ptr->name);
+	WriteServ(user->fd,"324 %s %s +%s",user->nick, Ptr->name,chanmodes(Ptr));
+	WriteServ(user->fd,"329 %s %s %d", user->nick, Ptr->name, Ptr->created);
+	FOREACH_MOD OnUserJoin(user,Ptr);
+	return Ptr;
 }
 
 /* remove a channel from a users record, and remove the record from memory
@@ -997,7 +1265,6 @@ struct chanrec* add_channel(struct userrec *user, char* cname, char* key)
 
 struct chanrec* del_channel(struct userrec *user, char* cname, char* reason)
 {
-	int i = 0;
 	struct chanrec* Ptr;
 	int created = 0;
 
@@ -1016,48 +1283,29 @@ struct chanrec* del_channel(struct userrec *user, char* cname, char* reason)
 	FOREACH_MOD OnUserPart(user,Ptr);
 	debug("del_channel: removing: %s %s",user->nick,Ptr->name);
 	
-	for (i =0; i <= MAXCHANS; i++)
+	/* zap it from the channel list of the user */
+	struct ucrec* uc = find_ucrec(user,Ptr);
+	if (uc)
 	{
-		/* zap it from the channel list of the user */
-		if (user->chans[i].channel == Ptr)
+		if (reason)
 		{
-			if (reason)
-			{
-				WriteChannel(Ptr,user,"PART %s :%s",Ptr->name, reason);
-			}
-			else
-			{
-				WriteChannel(Ptr,user,"PART :%s",Ptr->name);
-			}
-			user->chans[i].uc_modes = 0;
-			user->chans[i].channel = NULL;
-			debug("del_channel: unlinked: %s %s",user->nick,Ptr->name);
-			break;
+			WriteChannel(Ptr,user,"PART %s :%s",Ptr->name, reason);
 		}
-	}
-	
-	/* if there are no users left on the channel */
-	if (!usercount(Ptr))
-	{
-		chan_hash::iterator iter = chanlist.find(Ptr->name);
-
-		debug("del_channel: destroying channel: %s",Ptr->name);
-
-		/* kill the record */
-		if (iter != chanlist.end())
+		else
 		{
-			debug("del_channel: destroyed: %s",Ptr->name);
-			bzero(iter->second,sizeof(chanrec));
-			delete iter->second;
-			chanlist.erase(iter);
+			WriteChannel(Ptr,user,"PART :%s",Ptr->name);
 		}
+		part_member(user,uc);
+		debug("del_channel: unlinked: %s %s",user->nick,Ptr->name);
 	}
+	
+	/* if there are no users left on the channel */
+	free_channel(Ptr);
 }
 
 
 void kick_channel(struct userrec *src,struct userrec *user, struct chanrec *Ptr, char* reason)
 {
-	int i = 0;
 	int created = 0;
 
 	if ((!Ptr) || (!user) || (!src))
@@ -1086,62 +1334,121 @@ void kick_channel(struct userrec *src,struct userrec *user, struct chanrec *Ptr,
 		return;
 	}
 	
-	for (i =0; i <= MAXCHANS; i++)
-	{
-		/* zap it from the channel list of the user */
-		if (user->chans[i].channel == Ptr)
-		{
-			WriteChannel(Ptr,src,"KICK %s %s :%s",Ptr->name, user->nick, reason);
-			user->chans[i].uc_modes = 0;
-			user->chans[i].channel = NULL;
-			debug("del_channel: unlinked: %s %s",user->nick,Ptr->name);
-			break;
-		}
-	}
+	/* zap it from the channel list of the user */
+	WriteChannel(Ptr,src,"KICK %s %s :%s",Ptr->name, user->nick, reason);
+	part_member(user,find_ucrec(user,Ptr));
+	debug("del_channel: unlinked: %s %s",user->nick,Ptr->name);
 	
 	/* if there are no users left on the channel */
-	if (!usercount(Ptr))
+	free_channel(Ptr);
+}
+
+/* orders a user's channel list by channel address */
+
+bool ucrec_before(const struct ucrec* uc, const struct chanrec* c)
+{
+	return uc->channel < c;
+}
+
+/* returns the record of a user being on a channel, or NULL if they aren't
+ * on it. A user's channel list is kept sorted, so this is a binary search
+ * of a few pointers */
+
+struct ucrec* find_ucrec(struct userrec *u, struct chanrec *c)
+{
+	if ((!u) || (!c))
+	{
+		return NULL;
+	}
+
+	vector<ucrec*>::iterator i = lower_bound(u->chans.begin(),u->chans.end(),c,ucrec_before);
+
+	if ((i == u->chans.end()) || ((*i)->channel != c))
 	{
-		chan_hash::iterator iter = chanlist.find(Ptr->name);
+		return NULL;
+	}
+	return *i;
+}
 
-		debug("del_channel: destroying channel: %s",Ptr->name);
+/* links a new record of a user being on a channel into the user's channel
+ * list and the channel's member list */
 
-		/* kill the record */
-		if (iter != chanlist.end())
-		{
-			debug("del_channel: destroyed: %s",Ptr->name);
-			bzero(iter->second,sizeof(chanrec));
-			delete iter->second;
-			chanlist.erase(iter);
-		}
+void join_member(struct userrec *user, struct ucrec *uc)
+{
+	uc->user = user;
+	uc->member = uc->channel->members.size();
+	uc->channel->members.push_back(uc);
+	user->chans.insert(lower_bound(user->chans.begin(),user->chans.end(),uc->channel,ucrec_before),uc);
+	if (uc->channel->names_valid)
+	{
+		names_add(uc->channel,user);
 	}
 }
 
+/* unlinks a user's record of a channel from both lists and frees it. The
+ * last member takes the leaving one's place, so this costs the same
+ * however big the channel is */
 
-/* returns 1 if user u has channel c in their record, 0 if not */
+void part_member(struct userrec *user, struct ucrec *uc)
+{
+	vector<ucrec*> &members = uc->channel->members;
+
+	members[uc->member] = members.back();
+	members[uc->member]->member = uc->member;
+	members.pop_back();
+	names_invalidate(uc->channel);
+	user->chans.erase(lower_bound(user->chans.begin(),user->chans.end(),uc->channel,ucrec_before));
+	delete uc;
+}
 
-int has_channel(struct userrec *u, struct chanrec *c)
+/* destroys a channel record once the last user has left it */
+
+void free_channel(struct chanrec *c)
 {
-	int i = 0;
+	if (!c->members.empty())
+	{
+		return;
+	}
 
-	if (!u)
+	chan_hash::iterator iter = chanlist.find(c->name);
+
+	debug("del_channel: destroying channel: %s",c->name);
+
+	/* kill the record */
+	if (iter != chanlist.end())
 	{
-		return 0;
+		debug("del_channel: destroyed: %s",c->name);
+		delete iter->second;
+		chanlist.erase(iter);
 	}
-	for (i =0; i <= MAXCHANS; i++)
+}
+
+/* takes a departing user off every channel they are on, destroying any
+ * channel left empty. Nothing is sent to the channels, the caller has
+ * already told everyone */
+
+void part_all(struct userrec *user)
+{
+	while (!user->chans.empty())
 	{
-		if (u->chans[i].channel == c)
-		{
-			return 1;
-		}
+		struct chanrec* c = user->chans.back()->channel;
+
+		part_member(user,user->chans.back());
+		free_channel(c);
 	}
-	return 0;
+}
+
+
+/* returns 1 if user u has channel c in their record, 0 if not */
+
+int has_channel(struct userrec *u, struct chanrec *c)
+{
+	return (find_ucrec(u,c) != NULL);
 }
 
 int give_ops(struct userrec *user,char *dest,struct chanrec *chan,int status)
 {
 	struct userrec *d;
-	int i;
 	
 	if ((!user) || (!dest) || (!chan))
 	{
@@ -1167,18 +1474,17 @@ int give_ops(struct userrec *user,char *dest,struct chanrec *chan,int status)
 		}
 		else
 		{
-			for (i = 0; i <= MAXCHANS; i++)
+			struct ucrec* uc = find_ucrec(d,chan);
+			if (uc)
 			{
-				if ((d->chans[i].channel == chan) && (chan != NULL))
+				if (uc->uc_modes & UCMODE_OP)
 				{
-					if (d->chans[i].uc_modes & UCMODE_OP)
-					{
-						/* mode already set on user, dont allow multiple */
-						return 0;
-					}
-					d->chans[i].uc_modes = d->chans[i].uc_modes | UCMODE_OP;
-					debug("gave ops: %s %s",d->chans[i].channel->name,d->nick);
+					/* mode already set on user, dont allow multiple */
+					return 0;
 				}
+				uc->uc_modes = uc->uc_modes | UCMODE_OP;
+				names_invalidate(uc->channel);
+				debug("gave ops: %s %s",uc->channel->name,d->nick);
 			}
 		}
 	}
@@ -1188,7 +1494,6 @@ int give_ops(struct userrec *user,char *dest,struct chanrec *chan,int status)
 int give_hops(struct userrec *user,char *dest,struct chanrec *chan,int status)
 {
 	struct userrec *d;
-	int i;
 	
 	if ((!user) || (!dest) || (!chan))
 	{
@@ -1214,18 +1519,17 @@ int give_hops(struct userrec *user,char *dest,struct chanrec *chan,int status)
 		}
 		else
 		{
-			for (i = 0; i <= MAXCHANS; i++)
+			struct ucrec* uc = find_ucrec(d,chan);
+			if (uc)
 			{
-				if ((d->chans[i].channel == chan) && (chan != NULL))
+				if (uc->uc_modes & UCMODE_HOP)
 				{
-					if (d->chans[i].uc_modes & UCMODE_HOP)
-					{
-						/* mode already set on user, dont allow multiple */
-						return 0;
-					}
-					d->chans[i].uc_modes = d->chans[i].uc_modes | UCMODE_HOP;
-					debug("gave h-ops: %s %s",d->chans[i].channel->name,d->nick);
+					/* mode already set on user, dont allow multiple */
+					return 0;
 				}
+				uc->uc_modes = uc->uc_modes | UCMODE_HOP;
+				names_invalidate(uc->channel);
+				debug("gave h-ops: %s %s",uc->channel->name,d->nick);
 			}
 		}
 	}
@@ -1235,7 +1539,6 @@ int give_hops(struct userrec *user,char *dest,struct chanrec *chan,int status)
 int give_voice(struct userrec *user,char *dest,struct chanrec *chan,int status)
 {
 	struct userrec *d;
-	int i;
 	
 	if ((!user) || (!dest) || (!chan))
 	{
@@ -1261,18 +1564,17 @@ int give_voice(struct userrec *user,char *dest,struct chanrec *chan,int status)
 		}
 		else
 		{
-			for (i = 0; i <= MAXCHANS; i++)
+			struct ucrec* uc = find_ucrec(d,chan);
+			if (uc)
 			{
-				if ((d->chans[i].channel == chan) && (chan != NULL))
+				if (uc->uc_modes & UCMODE_VOICE)
 				{
-					if (d->chans[i].uc_modes & UCMODE_VOICE)
-					{
-						/* mode already set on user, dont allow multiple */
-						return 0;
-					}
-					d->chans[i].uc_modes = d->chans[i].uc_modes | UCMODE_VOICE;
-					debug("gave voice: %s %s",d->chans[i].channel->name,d->nick);
+					/* mode already set on user, dont allow multiple */
+					return 0;
 				}
+				uc->uc_modes = uc->uc_modes | UCMODE_VOICE;
+				names_invalidate(uc->channel);
+				debug("gave voice: %s %s",uc->channel->name,d->nick);
 			}
 		}
 	}
@@ -1282,7 +1584,6 @@ int give_voice(struct userrec *user,char *dest,struct chanrec *chan,int status)
 int take_ops(struct userrec *user,char *dest,struct chanrec *chan,int status)
 {
 	struct userrec *d;
-	int i;
 	
 	if ((!user) || (!dest) || (!chan))
 	{
@@ -1308,18 +1609,17 @@ int take_ops(struct userrec *user,char *dest,struct chanrec *chan,int status)
 		}
 		else
 		{
-			for (i = 0; i <= MAXCHANS; i++)
+			struct ucrec* uc = find_ucrec(d,chan);
+			if (uc)
 			{
-				if ((d->chans[i].channel == chan) && (chan != NULL))
+				if ((uc->uc_modes & UCMODE_OP) == 0)
 				{
-					if ((d->chans[i].uc_modes & UCMODE_OP) == 0)
-					{
-						/* mode already set on user, dont allow multiple */
-						return 0;
-					}
-					d->chans[i].uc_modes ^= UCMODE_OP;
-					debug("took ops: %s %s",d->chans[i].channel->name,d->nick);
+					/* mode already set on user, dont allow multiple */
+					return 0;
 				}
+				uc->uc_modes ^= UCMODE_OP;
+				names_invalidate(uc->channel);
+				debug("took ops: %s %s",uc->channel->name,d->nick);
 			}
 		}
 	}
@@ -1329,7 +1629,6 @@ int take_ops(struct userrec *user,char *dest,struct chanrec *chan,int status)
 int take_hops(struct userrec *user,char *dest,struct chanrec *chan,int status)
 {
 	struct userrec *d;
-	int i;
 	
 	if ((!user) || (!dest) || (!chan))
 	{
@@ -1355,18 +1654,17 @@ int take_hops(struct userrec *user,char *dest,struct chanrec *chan,int status)
 		}
 		else
 		{
-			for (i = 0; i <= MAXCHANS; i++)
+			struct ucrec* uc = find_ucrec(d,chan);
+			if (uc)
 			{
-				if ((d->chans[i].channel == chan) && (chan != NULL))
+				if ((uc->uc_modes & UCMODE_HOP) == 0)
 				{
-					if ((d->chans[i].uc_modes & UCMODE_HOP) == 0)
-					{
-						/* mode already set on user, dont allow multiple */
-						return 0;
-					}
-					d->chans[i].uc_modes ^= UCMODE_HOP;
-					debug("took h-ops: %s %s",d->chans[i].channel->name,d->nick);
+					/* mode already set on user, dont allow multiple */
+					return 0;
 				}
+				uc->uc_modes ^= UCMODE_HOP;
+				names_invalidate(uc->channel);
+				debug("took h-ops: %s %s",uc->channel->name,d->nick);
 			}
 		}
 	}
@@ -1376,7 +1674,6 @@ int take_hops(struct userrec *user,char *dest,struct chanrec *chan,int status)
 int take_voice(struct userrec *user,char *dest,struct chanrec *chan,int status)
 {
 	struct userrec *d;
-	int i;
 	
 	if ((!user) || (!dest) || (!chan))
 	{
@@ -1402,18 +1699,17 @@ int take_voice(struct userrec *user,char *dest,struct chanrec *chan,int status)
 		}
 		else
 		{
-			for (i = 0; i <= MAXCHANS; i++)
+			struct ucrec* uc = find_ucrec(d,chan);
+			if (uc)
 			{
-				if ((d->chans[i].channel == chan) && (chan != NULL))
+				if ((uc->uc_modes & UCMODE_VOICE) == 0)
 				{
-					if ((d->chans[i].uc_modes & UCMODE_VOICE) == 0)
-					{
-						/* mode already set on user, dont allow multiple */
-						return 0;
-					}
-					d->chans[i].uc_modes ^= UCMODE_VOICE;
-					debug("took voice: %s %s",d->chans[i].channel->name,d->nick);
+					/* mode already set on user, dont allow multiple */
+					return 0;
 				}
+				uc->uc_modes ^= UCMODE_VOICE;
+				names_invalidate(uc->channel);
+				debug("took voice: %s %s",uc->channel->name,d->nick);
 			}
 		}
 	}
@@ -1746,36 +2042,10 @@ void handle_mode(char **parameters, int pcnt, struct userrec *user)
 				}
 				if (can_change)
 				{
-					if (direction == 1)
-					{
-						if (!strchr(dest->modes,parameters[1][i]))
-						{
-							dest->modes[strlen(dest->modes)+1]='\0';
-							dest->modes[strlen(dest->modes)] = parameters[1][i];
-							outpars[strlen(outpars)+1]='\0';
-							outpars[strlen(outpars)] = parameters[1][i];
-						}
-					}
-					else
+					if ((set_umode(dest,parameters[1][i],direction)) || (direction == 0))
 					{
-						int q = 0;
-						char temp[MAXBUF];
-						char moo[MAXBUF];
-
 						outpars[strlen(outpars)+1]='\0';
 						outpars[strlen(outpars)] = parameters[1][i];
-						
-						strcpy(temp,"");
-						for (q = 0; q < strlen(user->modes); q++)
-						{
-							if (user->modes[q] != parameters[1][i])
-							{
-								moo[0] = user->modes[q];
-								moo[1] = '\0';
-								strcat(temp,moo);
-							}
-						}
-						strcpy(user->modes,temp);
 					}
 				}
 			}
@@ -1966,7 +2236,7 @@ void handle_join(char **parameters, int pcnt, struct userrec *user)
 	u = user;
 	if (loop_call(handle_join,parameters,pcnt,user,0,0,1))
 		return;
-	if (parameters[0][0] == '#') {
+	if (ischan(parameters[0])) {
 	Ptr = add_channel(user,parameters[0],parameters[1]);
 	}
 }
@@ -2060,25 +2330,32 @@ void kill_link(struct userrec *user,char* reason)
 	WriteOpers("*** Client exiting: %s!%s@%s [%s]",user->nick,user->ident,user->host,reason);
 	FOREACH_MOD OnUserQuit(user);
 	debug("closing fd %d",user->fd);
+	WriteCommonExcept(user,"QUIT :%s",reason);
+	/* last chance for the ERROR line, anything left after this is lost */
+	FlushClient(user);
 	/* bugfix, cant close() a nonblocking socket (sux!) */
 	Blocking(user->fd);
-	WriteCommonExcept(user,"QUIT :%s");
+	SE->DelFd(user->fd);
+	fd_ref_table[user->fd] = NULL;
 	close(user->fd);
 	NonBlocking(user->fd);
 	user->fd = 0;
-	user->modes[0] = '\0';
+	clear_umodes(user);
 	user->nick[0] = '\0';
+	if (user->registered == 7)
+	{
+		count_user(0);
+	}
 	user->registered = 0;
 
+	part_all(user);
+	end_list(user);
 	if (iter != clientlist.end())
 	{
 		debug("deleting user hash value");
-		bzero(iter->second,sizeof(userrec));
 		delete iter->second;
 		clientlist.erase(iter);
 	}
-	
-	purge_empty_chans();
 }
 
 
@@ -2180,6 +2457,7 @@ void Error(int status)
 
 int main (int argc, char *argv[])
 {
+	InitHashKey();
 	Start();
         debug("*** InspIRCd starting up!");
 	if (!CheckConfig())
@@ -2215,7 +2493,7 @@ struct userrec* ReHashNick(char* Old, char* New)
 
 	debug("ReHashNick: %s %s",Old,New);
 	
-	if (!strcasecmp(Old,New))
+	if (irc_equal(Old,New))
 	{
 		debug("old nick is new nick, skipping");
 		return oldnick->second;
@@ -2225,23 +2503,48 @@ struct userrec* ReHashNick(char* Old, char* New)
 
 	debug("ReHashNick: Found hashed nick %s",Old);
 
-	clientlist[New] = new userrec;
-	clientlist[New] = oldnick->second;
-	/*delete oldnick->second; */
+	/* adding New may rebuild the table, so let go of oldnick first */
+	userrec* user = oldnick->second;
 	clientlist.erase(oldnick);
+	clientlist[New] = user;
 
 	debug("ReHashNick: Nick rehashed as %s",New);
 	
-	return clientlist[New];
+	return user;
 }
 
 
+/* called when the reverse lookup for a new client finishes. If they have
+ * already sent USER and NICK they were only waiting for this, so connect
+ * them now */
+
+void HostResolved(struct dnsrec* lookup, char* host)
+{
+	userrec* user = (userrec*)lookup->data;
+
+	if (host)
+	{
+		WriteServ(user->fd,"NOTICE Auth :Found your hostname%s",lookup->cached ? " (cached)" : "");
+		strncpy(user->host,host,256);
+		strncpy(user->dhost,host,256);
+	}
+	else
+	{
+		WriteServ(user->fd,"NOTICE Auth :Couldn't resolve your hostname; using your IP address instead");
+	}
+	user->dns_done = 1;
+	if (user->registered == 3)
+	{
+		ConnectUser(user);
+	}
+}
+
 /* add a client connection to the sockets list */
-void AddClient(int socket, char* host, int port, bool iscached)
+void AddClient(int socket, char* host, int port)
 {
 	int i;
 	int blocking = 1;
-	char resolved[MAXBUF];
+	struct in_addr addr;
 	string tempnick;
 	char tn2[MAXBUF];
 	user_hash::iterator iter;
@@ -2253,6 +2556,13 @@ void AddClient(int socket, char* host, int port, bool iscached)
 
 	if (iter != clientlist.end()) return;
 
+	if (!SE->AddFd(socket,X_ESTAB_CLIENT))
+	{
+		debug("AddClient: socket engine refused fd %d",socket);
+		close(socket);
+		return;
+	}
+
 	/*
 	 * It is OK to access the value here this way since we know
 	 * it exists, we just created it above.
@@ -2260,15 +2570,14 @@ void AddClient(int socket, char* host, int port, bool iscached)
 	 * At NO other time should you access a value in a map or a
 	 * hash_map this way.
 	 */
-	clientlist[tempnick] = new userrec;
+	clientlist[tempnick] = new userrec();
 
-	NonBlocking(socket);
         debug("AddClient: %d %s %d",socket,host,port);
 
-
-	bzero(clientlist[tempnick],sizeof(userrec));
 	clientlist[tempnick]->fd = socket;
+	fd_ref_table[socket] = clientlist[tempnick];
 	strncpy(clientlist[tempnick]->nick, tn2,256);
+	clientlist[tempnick]->validnick = isnick(tn2);
 	strncpy(clientlist[tempnick]->host, host,256);
 	strncpy(clientlist[tempnick]->dhost, host,256);
 	strncpy(clientlist[tempnick]->server, ServerName,256);
@@ -2277,22 +2586,19 @@ void AddClient(int socket, char* host, int port, bool iscached)
 	clientlist[tempnick]->nping = time(NULL)+240;
 	clientlist[tempnick]->lastping = 1;
 	clientlist[tempnick]->port = port;
+	AddTimer(&clientlist[tempnick]->regtimer,clientlist[tempnick]->nping,RegTimer,clientlist[tempnick]);
 
-	if (iscached)
+	WriteServ(socket,"NOTICE Auth :Looking up your hostname...");
+
+	/* the client stays unregistered until this comes back, see HostResolved() */
+	if (inet_aton(host,&addr))
 	{
-		WriteServ(socket,"NOTICE Auth :Found your hostname (cached)...");
+		ReverseLookup(&clientlist[tempnick]->dns,addr,HostResolved,clientlist[tempnick]);
 	}
 	else
 	{
-		WriteServ(socket,"NOTICE Auth :Looking up your hostname...");
+		clientlist[tempnick]->dns_done = 1;
 	}
-
-	if(CleanAndResolve(resolved, host) != TRUE)
-	{
-		snprintf(resolved,MAXBUF,"%s",host);
-	}			
-	strncpy(clientlist[tempnick]->host,resolved,256);
-	strncpy(clientlist[tempnick]->dhost,resolved,256);
 	if (clientlist.size() == MAXCLIENTS)
 		kill_link(clientlist[tempnick],"No more connections allowed in this class");
 }
@@ -2395,37 +2701,32 @@ void handle_notice(char **parameters, int pcnt, struct userrec *user)
 	}
 }
 
-char lst[MAXBUF];
+/* sends user the 319 lines of a WHOIS on dest, listing dest's channels.
+ * As many are put on each line as fit, counting the ":<server> 319 ..."
+ * prefix WriteServ adds, so a user on a lot of channels gets several
+ * lines rather than a list cut short */
 
-char* chlist(struct userrec *user)
+void chlist(struct userrec *user, struct userrec *dest)
 {
-	int i = 0;
-	char cmp[MAXBUF];
+	unsigned int limit = 480 - strlen(ServerName) - strlen(user->nick) - strlen(dest->nick) - 9;
+	std::string line;
 
-        debug("chlist: %s",user->nick);
-	strcpy(lst,"");
-	if (!user)
-	{
-		return lst;
-	}
-	for (i = 0; i < MAXCHANS; i++)
+	debug("chlist: %s",dest->nick);
+	for (unsigned int i = 0; i < dest->chans.size(); i++)
 	{
-		if (user->chans[i].channel != NULL)
+		std::string entry = std::string(cmode(dest,dest->chans[i]->channel)) + dest->chans[i]->channel->name + " ";
+
+		if ((!line.empty()) && (line.length() + entry.length() > limit))
 		{
-			if (user->chans[i].channel->name)
-			{
-				strcpy(cmp,user->chans[i].channel->name);
-				strcat(cmp," ");
-				if (!strstr(lst,cmp))
-				{
-					strcat(lst,cmode(user,user->chans[i].channel));
-					strcat(lst,user->chans[i].channel->name);
-					strcat(lst," ");
-				}
-			}
+			WriteServ(user->fd,"319 %s %s :%s",user->nick, dest->nick, line.c_str());
+			line = "";
 		}
+		line += entry;
+	}
+	if (!line.empty())
+	{
+		WriteServ(user->fd,"319 %s %s :%s",user->nick, dest->nick, line.c_str());
 	}
-	return lst;
 }
 
 void handle_info(char **parameters, int pcnt, struct userrec *user)
@@ -2462,10 +2763,7 @@ void handle_whois(char **parameters, int pcnt, struct userrec *user)
 		{
 			WriteServ(user->fd,"378 %s %s :is connecting from *@%s",user->nick, dest->nick, dest->host);
 		}
-		if (strcmp(chlist(dest),""))
-		{
-			WriteServ(user->fd,"319 %s %s :%s",user->nick, dest->nick, chlist(dest));
-		}
+		chlist(user,dest);
 		WriteServ(user->fd,"312 %s %s %s :%s",user->nick, dest->nick, dest->server, ServerDesc);
 		if (strstr(dest->modes,"o"))
 		{
@@ -2508,100 +2806,371 @@ void handle_quit(char **parameters, int pcnt, struct userrec *user)
 
 	FOREACH_MOD OnUserQuit(user);
 
+	/* last chance for the ERROR line, anything left after this is lost */
+	FlushClient(user);
 	/* confucious say, he who close nonblocking socket, get nothing! */
 	Blocking(user->fd);
+	SE->DelFd(user->fd);
+	fd_ref_table[user->fd] = NULL;
 	close(user->fd);
 	NonBlocking(user->fd);
 
+	clear_umodes(user);
+	if (user->registered == 7)
+	{
+		count_user(0);
+	}
+	part_all(user);
+	end_list(user);
 	if (iter != clientlist.end())
 	{
 		debug("deleting user hash value");
-		bzero(iter->second,sizeof(userrec));
 		delete iter->second;
 		clientlist.erase(iter);
 	}
-	
-	purge_empty_chans();
 }
 
+/* gathers server numerics for one user into sendQ lines of up to
+ * BATCHSIZE bytes, so a long reply is queued as a few big lines instead
+ * of an allocation per numeric. Whatever is left over is queued by
+ * batch_flush(), which must be called when the reply is done */
+
+struct replybatch {
+	userrec* user;
+	int len;
+	char buf[BATCHSIZE];
+};
+
+void batch_flush(struct replybatch *b)
+{
+	if (b->len)
+	{
+		QueueLine(b->user,sendline(b->buf,b->len));
+		b->len = 0;
+	}
+}
+
+void batch_serv(struct replybatch *b, char* text, ...)
+{
+	char textbuffer[MAXBUF],tb[MAXBUF];
+	va_list argsPtr;
+	va_start (argsPtr, text);
+	vsnprintf(textbuffer, MAXBUF, text, argsPtr);
+	va_end(argsPtr);
+
+	int len = snprintf(tb,MAXBUF,":%s %s\r\n",ServerName,textbuffer);
+	if (len > 512)
+	{
+		/* irc max line length, as chop() */
+		tb[510] = '\r';
+		tb[511] = '\n';
+		len = 512;
+	}
+	if (b->len + len > BATCHSIZE)
+	{
+		batch_flush(b);
+	}
+	memcpy(b->buf + b->len,tb,len);
+	b->len += len;
+}
+
+/* one line of a WHO reply. c is the channel the user was found on, or
+ * NULL if they weren't found through a channel */
+
+void who_reply(struct replybatch *b, struct userrec *u, struct chanrec *c)
+{
+	batch_serv(b,"352 %s %s %s %s %s %s %s%s%s :0 %s",b->user->nick, c ? c->name : "*", u->ident, u->dhost, ServerName, u->nick, strcmp(u->awaymsg,"") ? "G" : "H", strchr(u->modes,'o') ? "*" : "", c ? cmode(u,c) : "", u->fullname);
+}
+
+/* true if u should be listed by a WHO for a mask. all is set when the
+ * mask matches the server name, so everyone matches. Invisible users are
+ * only shown to opers and to those sharing a channel with them, whose
+ * channels handle_who() has stamped with the current epoch */
+
+int who_match(struct userrec *user, struct userrec *u, struct wildmask *m, int all)
+{
+	if ((u->registered != 7) || (!u->validnick))
+	{
+		return 0;
+	}
+	if ((!all) && (!match_mask(u->nick,m)) && (!match_mask(u->dhost,m)) && (!match_mask(u->ident,m)) && (!match_mask(u->fullname,m)))
+	{
+		return 0;
+	}
+	if ((u == user) || (!strchr(u->modes,'i')) || (strchr(user->modes,'o')))
+	{
+		return 1;
+	}
+	for (unsigned int i = 0; i < u->chans.size(); i++)
+	{
+		if (u->chans[i]->channel->epoch == epoch)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* WHO 0 (or *) lists the users sharing a channel with the requester, WHO
+ * #channel the channel's members and WHO mask anyone whose nick, ident,
+ * host, server or real name matches the mask. A second parameter of o
+ * narrows any of them to opers, which a mask query finds through the
+ * oper list rather than looking at every client. Mask queries stop after
+ * WHOLIMIT replies */
+
 void handle_who(char **parameters, int pcnt, struct userrec *user)
 {
-	struct chanrec* Ptr;
-	
-	/* theres more to do here, but for now just close the socket */
-	if (pcnt == 1)
+	replybatch b;
+	int opers = ((pcnt > 1) && (!strcmp(parameters[1],"o")));
+	char* target = parameters[0];
+
+	b.user = user;
+	b.len = 0;
+
+	/* stamp the requester's channels, and anyone listed from them so
+	 * they are only listed once */
+	epoch++;
+	for (unsigned int i = 0; i < user->chans.size(); i++)
+	{
+		user->chans[i]->channel->epoch = epoch;
+	}
+
+	if ((!strcmp(target,"0")) || (!strcmp(target,"*")))
 	{
-		if ((!strcmp(parameters[0],"0")) || (!strcmp(parameters[0],"*")))
+		for (unsigned int i = 0; i < user->chans.size(); i++)
 		{
-			Ptr = user->chans[0].channel;
-			printf(user->chans[0].channel->name);
-		  	for (user_hash::const_iterator i = clientlist.begin(); i != clientlist.end(); i++)
+			chanrec* c = user->chans[i]->channel;
+
+			for (unsigned int j = 0; j < c->members.size(); j++)
 			{
-				if ((common_channels(user,i->second)) && (isnick(i->second->nick)))
+				userrec* u = c->members[j]->user;
+
+				if ((u->epoch != epoch) && (u->validnick) && ((!opers) || (strchr(u->modes,'o'))))
 				{
-					WriteServ(user->fd,"352 %s %s %s %s %s %s Hr@ :0 %s",user->nick, Ptr->name, i->second->ident, i->second->dhost, ServerName, i->second->nick, i->second->fullname);
+					u->epoch = epoch;
+					who_reply(&b,u,c);
 				}
 			}
-			WriteServ(user->fd,"315 %s %s :End of /WHO list.",user->nick, Ptr->name);
+		}
+		target = "*";
+	}
+	else if (target[0] == '#')
+	{
+		chanrec* c = FindChan(target);
+
+		if (!c)
+		{
+			WriteServ(user->fd,"401 %s %s :No suck nick/channel",user->nick, target);
 			return;
 		}
-		if (parameters[0][0] = '#')
+		for (unsigned int j = 0; j < c->members.size(); j++)
 		{
-			Ptr = FindChan(parameters[0]);
-			if (Ptr)
+			userrec* u = c->members[j]->user;
+
+			if ((u->validnick) && ((!opers) || (strchr(u->modes,'o'))))
+			{
+				who_reply(&b,u,c);
+			}
+		}
+	}
+	else
+	{
+		wildmask m;
+		int all = match(ServerName,target);
+		int count = 0;
+
+		compile_mask(&m,target);
+		if (opers)
+		{
+			vector<userrec*> &list = umode_users[umode_index('o')];
+
+			for (unsigned int i = 0; i < list.size(); i++)
+			{
+				if (who_match(user,list[i],&m,all))
+				{
+					if (++count > WHOLIMIT)
+					{
+						break;
+					}
+					who_reply(&b,list[i],NULL);
+				}
+			}
+		}
+		else
+		{
+			for (user_hash::const_iterator i = clientlist.begin(); i != clientlist.end(); i++)
 			{
-			  	for (user_hash::const_iterator i = clientlist.begin(); i != clientlist.end(); i++)
+				if (who_match(user,i->second,&m,all))
 				{
-					if ((has_channel(i->second,Ptr)) && (isnick(i->second->nick)))
+					if (++count > WHOLIMIT)
 					{
-						WriteServ(user->fd,"352 %s %s %s %s %s %s Hr@ :0 %s",user->nick, Ptr->name, i->second->ident, i->second->dhost, ServerName, i->second->nick, i->second->fullname);
+						break;
 					}
+					who_reply(&b,i->second,NULL);
 				}
-				WriteServ(user->fd,"315 %s %s :End of /WHO list.",user->nick, Ptr->name);
+			}
+		}
+		if (count > WHOLIMIT)
+		{
+			batch_serv(&b,"416 %s WHO :output too large, truncated",user->nick);
+		}
+	}
+	batch_serv(&b,"315 %s %s :End of /WHO list.",user->nick, target);
+	batch_flush(&b);
+}
+
+void handle_wallops(char **parameters, int pcnt, struct userrec *user)
+{
+	WriteWallOps(user,"%s",parameters[0]);
+}
+
+/* a LIST in progress. The names of the channels to list are taken when
+ * the LIST is given and sent a batch at a time, so a client listing a
+ * big network is never handed more than its sendQ can take, and channels
+ * created or destroyed meanwhile don't upset where we are */
+
+struct listrec {
+	vector<string> names;	/* channels still to be listed */
+	unsigned int pos;	/* next entry in names to look at */
+	long minusers;		/* only list channels with at least this many users */
+	long maxusers;		/* and at most this many, LONG_MAX for no limit */
+	string topicmask;	/* and a topic matching this, if set */
+};
+
+/* LIST takes a comma seperated list of filters, all of which must be met:
+ * >n and <n for more or fewer than n users, T:mask for a topic matching
+ * mask, and channel names or masks, any one of which the name must match */
+
+void handle_list(char **parameters, int pcnt, struct userrec *user)
+{
+	vector<string> masks;
+	listrec* l = new listrec;
+
+	l->pos = 0;
+	l->minusers = 0;
+	l->maxusers = LONG_MAX;
+	if (pcnt)
+	{
+		char* filter = strtok(parameters[0],",");
+
+		while (filter)
+		{
+			if (filter[0] == '>')
+			{
+				l->minusers = atol(filter+1) + 1;
+			}
+			else if (filter[0] == '<')
+			{
+				l->maxusers = atol(filter+1) - 1;
+			}
+			else if ((filter[0] == 'T') && (filter[1] == ':'))
+			{
+				l->topicmask = filter+2;
 			}
 			else
 			{
-				WriteServ(user->fd,"401 %s %s :No suck nick/channel",user->nick, parameters[0]);
+				masks.push_back(filter);
 			}
+			filter = strtok(NULL,",");
+		}
+	}
+	for (chan_hash::const_iterator i = chanlist.begin(); i != chanlist.end(); i++)
+	{
+		int found = masks.empty();
+
+		for (unsigned int m = 0; (m < masks.size()) && (!found); m++)
+		{
+			found = match(i->second->name,masks[m].c_str());
 		}
+		if (found)
+		{
+			l->names.push_back(i->second->name);
+		}
+	}
+
+	/* a new LIST replaces one still being sent */
+	end_list(user);
+	user->listing = l;
+	list_users.push_back(user);
+	WriteServ(user->fd,"321 %s Channel :Users Name",user->nick);
+	list_turn(user);
+}
+
+/* sends the next batch of a user's LIST, stopping early once the sendQ
+ * holds LISTROOM bytes. Returns false when the list is finished */
+
+int list_turn(struct userrec *user)
+{
+	listrec* l = user->listing;
+
+	for (int n = 0; (n < LISTBATCH) && (l->pos < l->names.size()) && (user->sendqlen < LISTROOM); n++)
+	{
+		chanrec* c = FindChan(l->names[l->pos++].c_str());
+
+		if (!c)
+		{
+			/* gone since the LIST was given */
+			continue;
+		}
+		long users = usercount(c);
+		if ((users < l->minusers) || (users > l->maxusers))
+		{
+			continue;
+		}
+		if ((l->topicmask.length()) && (!match(c->topic,l->topicmask.c_str())))
+		{
+			continue;
+		}
+		WriteServ(user->fd,"322 %s %s %ld :[+%s] %s",user->nick,c->name,users,chanmodes(c),c->topic);
 	}
-	if (pcnt == 2)
+	if (l->pos < l->names.size())
 	{
-                if ((!strcmp(parameters[0],"0")) || (!strcmp(parameters[0],"*")) && (!strcmp(parameters[1],"o")))
-                {
-                        Ptr = user->chans[0].channel;
-                        printf(user->chans[0].channel->name);
-		  	for (user_hash::const_iterator i = clientlist.begin(); i != clientlist.end(); i++)
-                        {
-                                if ((common_channels(user,i->second)) && (isnick(i->second->nick)))
-                                {
-                                        if (strstr(i->second->modes,"o"))
-                                        {
-                                                WriteServ(user->fd,"352 %s %s %s %s %s %s Hr@ :0 %s",user->nick, Ptr->name, i->second->ident, i->second->dhost, ServerName, i->second->nick, i->second->fullname);
-                                        }
-                                }
-                        }
-                        WriteServ(user->fd,"315 %s %s :End of /WHO list.",user->nick, Ptr->name);
-                        return;
-                }
+		return 1;
 	}
+	WriteServ(user->fd,"323 %s :End of channel list.",user->nick);
+	end_list(user);
+	return 0;
 }
 
-void handle_wallops(char **parameters, int pcnt, struct userrec *user)
+/* forgets a user's LIST, if they have one going */
+
+void end_list(struct userrec *user)
 {
-	WriteWallOps(user,"%s",parameters[0]);
+	if (!user->listing)
+	{
+		return;
+	}
+	delete user->listing;
+	user->listing = NULL;
+	list_users.erase(find(list_users.begin(),list_users.end(),user));
+}
+
+/* gives everyone with a LIST going and room in their sendQ another batch.
+ * The rest are picked up again once their sendQ has been written out */
+
+void ListChannels(void)
+{
+	for (unsigned int i = 0; i < list_users.size(); )
+	{
+		if ((list_users[i]->sendqlen >= LISTROOM) || (list_turn(list_users[i])))
+		{
+			i++;
+		}
+	}
 }
 
-void handle_list(char **parameters, int pcnt, struct userrec *user)
+/* true if any LIST can be carried on right away */
+
+int ListReady(void)
 {
-	struct chanrec* Ptr;
-	
-	WriteServ(user->fd,"321 %s Channel :Users Name",user->nick);
-	for (chan_hash::const_iterator i = chanlist.begin(); i != chanlist.end(); i++)
+	for (unsigned int i = 0; i < list_users.size(); i++)
 	{
-		WriteServ(user->fd,"322 %s %s %d :[+%s] %s",user->nick,i->second->name,usercount(i->second),chanmodes(i->second),i->second->topic);
+		if (list_users[i]->sendqlen < LISTROOM)
+		{
+			return 1;
+		}
 	}
-	WriteServ(user->fd,"323 %s :End of channel list.",user->nick);
+	return 0;
 }
 
 
@@ -2613,62 +3182,72 @@ void handle_rehash(char **parameters, int pcnt, struct userrec *user)
 }
 
 
-int usercnt(void)
+/* the counts shown by LUSERS and /stats z. Nothing here looks at more
+ * than one client, they are all kept up to date as users register, quit
+ * and change modes */
+
+extern "C" int usercnt(void)
 {
-	return clientlist.size();
+	return registered_users;
 }
 
-int usercount_invisible(void)
+extern "C" int usercount_invisible(void)
 {
-	int c = 0;
-
-	for (user_hash::const_iterator i = clientlist.begin(); i != clientlist.end(); i++)
-	{
-		if ((i->second->fd) && (isnick(i->second->nick)) && (strchr(i->second->modes,'i'))) c++;
-	}
-	return c;
+	return umode_users[umode_index('i')].size();
 }
 
-int usercount_opers(void)
+extern "C" int usercount_opers(void)
 {
-	int c = 0;
-
-	for (user_hash::const_iterator i = clientlist.begin(); i != clientlist.end(); i++)
-	{
-		if ((i->second->fd) && (isnick(i->second->nick)) && (strchr(i->second->modes,'o'))) c++;
-	}
-	return c;
+	return umode_users[umode_index('o')].size();
 }
 
-int usercount_unknown(void)
+extern "C" int usercount_unknown(void)
 {
-	int c = 0;
+	return clientlist.size() - registered_users;
+}
 
-	for (user_hash::const_iterator i = clientlist.begin(); i != clientlist.end(); i++)
-	{
-		if ((i->second->fd) && (i->second->registered != 7))
-			c++;
-	}
-	return c;
+extern "C" int usercount_max(void)
+{
+	return max_users;
 }
 
-int chancount(void)
+extern "C" int chancount(void)
 {
 	return chanlist.size();
 }
 
-int servercount(void)
+extern "C" int servercount(void)
 {
 	return 1;
 }
 
+/* counts a user in or out of registered_users, called as they finish
+ * registering and as a registered user leaves */
+
+void count_user(int adding)
+{
+	if (adding)
+	{
+		if (++registered_users > max_users)
+		{
+			max_users = registered_users;
+		}
+	}
+	else
+	{
+		registered_users--;
+	}
+}
+
 void handle_lusers(char **parameters, int pcnt, struct userrec *user)
 {
 	WriteServ(user->fd,"251 %s :There are %d users and %d invisible on %d servers",user->nick,usercnt(),usercount_invisible(),servercount());
 	WriteServ(user->fd,"252 %s %d :operator(s) online",user->nick,usercount_opers());
 	WriteServ(user->fd,"253 %s %d :unknown connections",user->nick,usercount_unknown());
 	WriteServ(user->fd,"254 %s %d :channels formed",user->nick,chancount());
-	WriteServ(user->fd,"254 %s :I have %d clients and 0 servers",user->nick,usercnt());
+	WriteServ(user->fd,"255 %s :I have %d clients and 0 servers",user->nick,usercnt());
+	WriteServ(user->fd,"265 %s :Current Local Users: %d  Max: %d",user->nick,usercnt(),usercount_max());
+	WriteServ(user->fd,"266 %s :Current Global Users: %d  Max: %d",user->nick,usercnt(),usercount_max());
 }
 
 void handle_admin(char **parameters, int pcnt, struct userrec *user)
@@ -2713,15 +3292,19 @@ void ShowRULES(struct userrec *user)
 void ConnectUser(struct userrec *user)
 {
 	user->registered = 7;
+	count_user(1);
 	user->idle_lastmsg = time(NULL);
+	DelTimer(&user->regtimer);
+	AddTimer(&user->pingtimer,user->nping,PingTimer,user);
         debug("ConnectUser: %s",user->nick);
 	WriteServ(user->fd,"NOTICE Auth :Welcome to \002%s\002!",Network);
 	WriteServ(user->fd,"001 %s :Welcome to the %s IRC Network %s!%s@%s",user->nick,Network,user->nick,user->ident,user->host);
 	WriteServ(user->fd,"002 %s :Your host is %s, running version %s",user->nick,ServerName,VERSION);
 	WriteServ(user->fd,"003 %s :This server was created %s %s",user->nick,__TIME__,__DATE__);
 	WriteServ(user->fd,"004 %s :%s %s iowghraAsORVSxNCWqBzvdHtGI lvhopsmntikrRcaqOALQbSeKVfHGCuzN",user->nick,ServerName,VERSION);
-	WriteServ(user->fd,"005 %s :MAP KNOCK SAFELIST HCN MAXCHANNELS=20 MAXBANS=60 NICKLEN=30 TOPICLEN=307 KICKLEN=307 MAXTARGETS=20 AWAYLEN=307 :are supported by this server",user->nick);
+	WriteServ(user->fd,"005 %s :MAP KNOCK SAFELIST ELIST=MU HCN MAXCHANNELS=20 MAXBANS=60 NICKLEN=30 TOPICLEN=307 KICKLEN=307 MAXTARGETS=20 AWAYLEN=307 :are supported by this server",user->nick);
 	WriteServ(user->fd,"005 %s :WALLCHOPS WATCH=128 SILENCE=5 MODES=13 CHANTYPES=# PREFIX=(ohv)@%c+ CHANMODES=ohvbeqa,kfL,l,psmntirRcOAQKVHGCuzN NETWORK=%s :are supported by this server",user->nick,'%',Network);
+	handle_lusers(NULL,0,user);
 	ShowMOTD(user);
 	FOREACH_MOD OnUserConnect(user);
 	WriteOpers("*** Client connecting on port %d: %s!%s@%s",user->port,user->nick,user->ident,user->host);
@@ -2769,7 +3352,7 @@ void handle_user(char **parameters, int pcnt, struct userrec *user)
 		return;
 	}
 	/* parameters 2 and 3 are local and remote hosts, ignored when sent by client connection */
-	if (user->registered == 3)
+	if ((user->registered == 3) && (user->dns_done))
 	{
 		/* user is registered now, bit 0 = USER command, bit 1 = sent a NICK command */
 		ConnectUser(user);
@@ -2832,11 +3415,19 @@ void handle_stats(char **parameters, int pcnt, struct userrec *user)
 	/* stats z (debug and memory info) */
 	if (!strcasecmp(parameters[0],"z"))
 	{
-		WriteServ(user->fd,"249 %s :Users(HASH_MAP) %d (%d bytes, %d buckets)",user->nick,clientlist.size(),clientlist.size()*sizeof(userrec),clientlist.bucket_count());
-		WriteServ(user->fd,"249 %s :Channels(HASH_MAP) %d (%d bytes, %d buckets)",user->nick,chanlist.size(),chanlist.size()*sizeof(chanrec),chanlist.bucket_count());
+		struct cachestats hc;
+		unsigned long probes[FH_PROBEBUCKETS];
+		clientlist.probe_stats(probes);
+		WriteServ(user->fd,"249 %s :Users(FLAT_HASH) %d (%d bytes, %d slots, %d%% full, probes 0:%lu 1:%lu 2-3:%lu 4-7:%lu 8+:%lu)",user->nick,clientlist.size(),clientlist.size()*sizeof(userrec),clientlist.slot_count(),clientlist.size()*100/clientlist.slot_count(),probes[0],probes[1],probes[2],probes[3],probes[4]);
+		chanlist.probe_stats(probes);
+		WriteServ(user->fd,"249 %s :Channels(FLAT_HASH) %d (%d bytes, %d slots, %d%% full, probes 0:%lu 1:%lu 2-3:%lu 4-7:%lu 8+:%lu)",user->nick,chanlist.size(),chanlist.size()*sizeof(chanrec),chanlist.slot_count(),chanlist.size()*100/chanlist.slot_count(),probes[0],probes[1],probes[2],probes[3],probes[4]);
+		WriteServ(user->fd,"249 %s :Lusers %d registered (max %d), %d unknown, %d invisible, %d opers",user->nick,usercnt(),usercount_max(),usercount_unknown(),usercount_invisible(),usercount_opers());
 		WriteServ(user->fd,"249 %s :Commands(VECTOR) %d (%d bytes)",user->nick,cmdlist.size(),cmdlist.size()*sizeof(command_t));
 		WriteServ(user->fd,"249 %s :MOTD(VECTOR) %d, RULES(VECTOR) %d",user->nick,MOTD.size(),RULES.size());
-		WriteServ(user->fd,"249 %s :address_cache(HASH_MAP) %d (%d buckets)",user->nick,IP.size(),IP.bucket_count());
+		WriteServ(user->fd,"249 %s :SocketEngine(%s) %d/%d descriptors",user->nick,SE->GetName(),SE->GetCurrentFds(),SE->GetMaxFds());
+		GetCacheStats(&hc);
+		WriteServ(user->fd,"249 %s :HostCache(LRU) %d/%d, %lu hits, %lu misses, %lu evictions",user->nick,hc.size,hc.max,hc.hits,hc.misses,hc.evictions);
+		WriteServ(user->fd,"249 %s :HostCache(FLAT_HASH) %d slots, %d%% full, probes 0:%lu 1:%lu 2-3:%lu 4-7:%lu 8+:%lu",user->nick,hc.slots,hc.size*100/hc.slots,hc.probes[0],hc.probes[1],hc.probes[2],hc.probes[3],hc.probes[4]);
 		WriteServ(user->fd,"249 %s :Modules(VECTOR) %d (%d)",user->nick,modules.size(),modules.size()*sizeof(Module));
 		WriteServ(user->fd,"249 %s :ClassFactories(VECTOR) %d (%d)",user->nick,factory.size(),factory.size()*sizeof(ircd_module));
 		WriteServ(user->fd,"249 %s :Ports(STATIC_ARRAY) %d",user->nick,boundPortCount);
@@ -2863,7 +3454,7 @@ void handle_stats(char **parameters, int pcnt, struct userrec *user)
 		WriteServ(user->fd,"211 %s :server:port nick bytes_in cmds_in bytes_out cmds_out",user->nick);
 	  	for (user_hash::iterator i = clientlist.begin(); i != clientlist.end(); i++)
 		{
-			if (isnick(user->nick))
+			if (i->second->validnick)
 			{
 				WriteServ(user->fd,"211 %s :%s:%d %s %d %d %d %d",user->nick,ServerName,i->second->port,i->second->nick,i->second->bytes_in,i->second->cmds_in,i->second->bytes_out,i->second->cmds_out);
 			}
@@ -2930,10 +3521,7 @@ void handle_oper(char **parameters, int pcnt, struct userrec *user)
 					strncpy(user->dhost,Hostname,256);
 				}
 			}
-			if (!strstr(user->modes,"o"))
-			{
-				strcat(user->modes,"o");
-			}
+			set_umode(user,'o',1);
 			return;
 		}
 	}
@@ -2969,7 +3557,7 @@ void handle_nick(char **parameters, int pcnt, struct userrec *user)
 		debug("invalid old nick passed to handle_nick");
 		return;
 	}
-	if (!strcasecmp(user->nick,parameters[0]))
+	if (irc_equal(user->nick,parameters[0]))
 	{
 		debug("old nick is new nick, skipping");
 		return;
@@ -3007,12 +3595,17 @@ void handle_nick(char **parameters, int pcnt, struct userrec *user)
 	if (!user->nick) return;
 
 	strncpy(user->nick, parameters[0],NICKMAX);
+	user->validnick = 1;
+	for (unsigned int i = 0; i < user->chans.size(); i++)
+	{
+		names_invalidate(user->chans[i]->channel);
+	}
 
 	debug("new nick set: %s",user->nick);
 	
 	if (user->registered < 3)
 		user->registered = (user->registered | 2);
-	if (user->registered == 3)
+	if ((user->registered == 3) && (user->dns_done))
 	{
 		/* user is registered now, bit 0 = USER command, bit 1 = sent a NICK command */
 		ConnectUser(user);
@@ -3160,7 +3753,7 @@ void process_command(struct userrec *user, char* cmd)
 		 * deny command! */
 					if ((strcmp(command,"USER")) && (strcmp(command,"NICK")) && (strcmp(command,"PASS")))
 					{
-						if ((!isnick(user->nick)) || (user->registered != 7))
+						if ((!user->validnick) || (user->registered != 7))
 						{
 						        debug("process_command: not registered: %s %s",user->nick,command);
 							WriteServ(user->fd,"451 %s :You have not registered",command);
@@ -3248,54 +3841,428 @@ void SetupCommandTable(void)
   createcommand("USERHOST",handle_userhost,0,1);
 }
 
+/* splits complete lines out of a user's recvQ and hands them to
+ * process_command() in the order they arrived, at most CmdBudget of them.
+ * A line ends at CR or LF, so CRLF pairs just produce an empty line which
+ * is skipped. If there are more lines than the budget allows the user is
+ * queued in run_list and the rest wait in the recvQ until their turn
+ * comes round again. Whatever follows the last line ending is a partial
+ * line and is left in the recvQ */
+
 void process_buffer(struct userrec *user)
 {
 	char cmd[MAXBUF];
-	int i;
-	if (!user->inbuf)
+	int fd = user->fd;
+	int budget = CmdBudget;
+	string::size_type pos = 0;
+
+	while (pos < user->recvq.length())
 	{
-		return;
+		if (!budget)
+		{
+			/* out of turns, come back to the rest later */
+			if ((!user->runnable) && (memchr(user->recvq.data()+pos,'\n',user->recvq.length()-pos) || memchr(user->recvq.data()+pos,'\r',user->recvq.length()-pos)))
+			{
+				user->runnable = 1;
+				run_list.push_back(fd);
+			}
+			break;
+		}
+
+		const char* base = user->recvq.data();
+		string::size_type left = user->recvq.length() - pos;
+		const char* eol = (const char*)memchr(base+pos,'\n',left);
+		const char* cr = (const char*)memchr(base+pos,'\r',eol ? eol-(base+pos) : left);
+
+		if (cr)
+		{
+			eol = cr;
+		}
+		if (!eol)
+		{
+			/* partial line, wait for the rest of it */
+			break;
+		}
+
+		string::size_type len = eol-(base+pos);
+		if (len > 510)
+		{
+			/* irc lines are limited to 512 bytes including the CR/LF */
+			len = 510;
+		}
+		memcpy(cmd,base+pos,len);
+		cmd[len] = '\0';
+		pos = (eol-base)+1;
+
+		if (!len)
+		{
+			continue;
+		}
+	        debug("InspIRCd: processing: %s %s",user->nick,cmd);
+		process_command(user,cmd);
+		budget--;
+
+		/* the command may have been QUIT or a KILL of ourselves, in which
+		 * case the record (and its recvQ) no longer exists */
+		if (fd_to_user(fd) != user)
+		{
+			return;
+		}
 	}
-	if (!strcmp(user->inbuf,""))
+	user->recvq.erase(0,pos);
+}
+
+/* gives every user waiting in run_list another turn, in the order they
+ * were queued. Anyone who still has lines left after their turn goes to
+ * the back of the queue for the next pass of the main loop */
+
+void RunCommands(void)
+{
+	for (unsigned int n = run_list.size(); n > 0; n--)
 	{
-		return;
+		int fd = run_list.front();
+		userrec* user = fd_to_user(fd);
+
+		run_list.pop_front();
+		if ((!user) || (!user->runnable))
+		{
+			continue;
+		}
+		user->runnable = 0;
+		process_buffer(user);
 	}
-	strncpy(cmd,user->inbuf,MAXBUF);
-	if (!strcmp(cmd,""))
+}
+
+/* drains every readable socket in fds into its user's recvQ using large
+ * reads. The reads go to the socket engine READBATCH at a time, so that
+ * one which can batch them makes a single system call for the lot, and a
+ * socket whose read filled its buffer is read again in the next round
+ * until it is drained. Then each user gets their turn at processing the
+ * lines they now hold. A user with a full recvQ of lines still waiting to
+ * be processed isn't read from until there is room, but one which fills
+ * its recvQ without ever sending a line ending is disconnected */
+
+void ReadClients(vector<int> &fds)
+{
+	static vector<char> buffer(READBATCH * READSIZE);
+	vector<sockop> ops;
+	vector<int> active, again;
+	sockop op;
+
+	memset(&op,0,sizeof(op));
+	op.type = OP_READ;
+	op.len = READSIZE;
+	for (unsigned int i = 0; i < fds.size(); i++)
 	{
-		return;
+		userrec* user = fd_to_user(fds[i]);
+
+		/* a user whose recvQ is full of lines waiting their turn is
+		 * left unread, so the kernel makes them slow down */
+		if ((user) && (user->recvq.length() < (size_t)RecvQMax))
+		{
+			active.push_back(fds[i]);
+		}
+	}
+	while (!active.empty())
+	{
+		again.clear();
+		for (unsigned int start = 0; start < active.size(); start += READBATCH)
+		{
+			ops.clear();
+			for (unsigned int i = start; (i < active.size()) && (i < start + READBATCH); i++)
+			{
+				op.fd = active[i];
+				op.buf = &buffer[(i - start) * READSIZE];
+				ops.push_back(op);
+			}
+			SE->Submit(ops);
+
+			for (unsigned int i = 0; i < ops.size(); i++)
+			{
+				userrec* user = fd_to_user(ops[i].fd);
+				int result = ops[i].result;
+
+				if (!user)
+				{
+					continue;
+				}
+				if (result > 0)
+				{
+					user->recvq.append(ops[i].buf,result);
+					if ((result == READSIZE) && (user->recvq.length() <= (size_t)RecvQMax))
+					{
+						/* full read, there may be more */
+						again.push_back(ops[i].fd);
+					}
+				}
+				else if (result == 0)
+				{
+					debug("InspIRCd: connection closed: %s",user->nick);
+					kill_link(user,"Connection closed");
+				}
+				else if (result == -EINTR)
+				{
+					again.push_back(ops[i].fd);
+				}
+				else if (result != -EAGAIN)
+				{
+					debug("InspIRCd: read error: %s %s",user->nick,strerror(-result));
+					kill_link(user,strerror(-result));
+				}
+			}
+		}
+		active.swap(again);
+	}
+
+	for (unsigned int i = 0; i < fds.size(); i++)
+	{
+		userrec* user = fd_to_user(fds[i]);
+
+		if ((!user) || (user->runnable))
+		{
+			/* already waiting for a turn in run_list */
+			continue;
+		}
+		process_buffer(user);
+		if (fd_to_user(fds[i]) != user)
+		{
+			continue;
+		}
+		if ((user->recvq.length() > (size_t)RecvQMax) && (!user->runnable))
+		{
+			debug("InspIRCd: recvq exceeded: %s %d",user->nick,user->recvq.length());
+			kill_link(user,"RecvQ exceeded");
+		}
 	}
-	if ((cmd[strlen(cmd)-1] == 13) || (cmd[strlen(cmd)-1] == 10))
+}
+
+/* points up to max iovecs at the unwritten part of a user's sendQ and
+ * returns how many were used */
+
+int SendQIovec(struct userrec *user, struct iovec* iov, int max)
+{
+	int count = 0;
+
+	for (deque<sendline>::iterator i = user->sendq.begin(); (i != user->sendq.end()) && (count < max); i++, count++)
 	{
-		cmd[strlen(cmd)-1] = '\0';
+		iov[count].iov_base = (char*)i->data();
+		iov[count].iov_len = i->length();
 	}
-	if ((cmd[strlen(cmd)-1] == 13) || (cmd[strlen(cmd)-1] == 10))
+	if (count)
 	{
-		cmd[strlen(cmd)-1] = '\0';
+		iov[0].iov_base = (char*)iov[0].iov_base + user->sendqpos;
+		iov[0].iov_len -= user->sendqpos;
 	}
-	strcpy(user->inbuf,"");
-	if (!strcmp(cmd,""))
+	return count;
+}
+
+/* removes count written bytes from the front of a user's sendQ */
+
+void SendQConsume(struct userrec *user, int count)
+{
+	user->sendqlen -= count;
+	count += user->sendqpos;
+	user->sendqpos = 0;
+	while ((!user->sendq.empty()) && (count >= user->sendq.front().length()))
+	{
+		count -= user->sendq.front().length();
+		user->sendq.pop_front();
+	}
+	user->sendqpos = count;
+}
+
+/* writes as much of a user's sendQ as the socket will take, gathering up
+ * to 64 queued lines into each writev(). If the socket fills up the engine
+ * is asked to tell us when it is writeable again. Returns -1 if the socket
+ * is dead, the caller is responsible for disconnecting the user */
+
+int FlushClient(struct userrec *user)
+{
+	struct iovec iov[WRITEBATCH];
+	int fd = user->fd;
+	int count, result;
+
+	while (!user->sendq.empty())
+	{
+		count = SendQIovec(user,iov,WRITEBATCH);
+		result = writev(fd,iov,count);
+		if (result < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno == EAGAIN)
+			{
+				break;
+			}
+			debug("FlushClient: write error: %s %s",user->nick,strerror(errno));
+			return -1;
+		}
+
+		SendQConsume(user,result);
+	}
+	SE->WantWrite(fd,!user->sendq.empty());
+	return 0;
+}
+
+/* flushes the sendQ of every socket which has been written to since the
+ * last call, disconnecting anyone whose sendQ has grown past the limit.
+ * One writev of up to WRITEBATCH lines per socket is handed to the socket
+ * engine as a single batch, anyone with more left than that is finished
+ * off by FlushClient() */
+
+void FlushWrites(void)
+{
+	static vector<sockop> ops;
+	static vector<struct iovec> iov;
+	static vector<char> queued;
+	unsigned int i = 0;
+	sockop op;
+
+	memset(&op,0,sizeof(op));
+	op.type = OP_WRITEV;
+	queued.resize(SE->GetMaxFds());
+
+	/* kill_link() queues more lines, so flush_list may grow as we go.
+	 * Whatever it adds is sent in another batch */
+	while (i < flush_list.size())
+	{
+		unsigned int end = flush_list.size();
+
+		ops.clear();
+		iov.resize((end - i) * WRITEBATCH);
+		for (int n = 0; i < end; i++)
+		{
+			userrec* user = fd_to_user(flush_list[i]);
+
+			if ((!user) || (user->sendq.empty()) || (queued[user->fd]))
+			{
+				continue;
+			}
+			if (user->sendqlen > SendQMax)
+			{
+				debug("FlushWrites: sendq exceeded: %s %d",user->nick,user->sendqlen);
+				user->sendq.clear();
+				user->sendqpos = 0;
+				user->sendqlen = 0;
+				kill_link(user,"SendQ exceeded");
+				continue;
+			}
+			/* the iovecs point into the sendQ, which is only ever added
+			 * to at the back until the batch has been sent */
+			op.fd = user->fd;
+			op.iov = &iov[n * WRITEBATCH];
+			op.iovcnt = SendQIovec(user,op.iov,WRITEBATCH);
+			ops.push_back(op);
+			queued[user->fd] = 1;
+			n++;
+		}
+		SE->Submit(ops);
+
+		for (unsigned int j = 0; j < ops.size(); j++)
+		{
+			queued[ops[j].fd] = 0;
+		}
+		for (unsigned int j = 0; j < ops.size(); j++)
+		{
+			userrec* user = fd_to_user(ops[j].fd);
+			int result = ops[j].result;
+
+			if (!user)
+			{
+				continue;
+			}
+			if ((result >= 0) || (result == -EINTR) || (result == -EAGAIN))
+			{
+				if (result > 0)
+				{
+					SendQConsume(user,result);
+				}
+				if ((result == -EAGAIN) || (user->sendq.empty()))
+				{
+					SE->WantWrite(user->fd,!user->sendq.empty());
+				}
+				else if (FlushClient(user) < 0)
+				{
+					kill_link(user,strerror(errno));
+				}
+			}
+			else
+			{
+				debug("FlushWrites: write error: %s %s",user->nick,strerror(-result));
+				kill_link(user,strerror(-result));
+			}
+		}
+	}
+	flush_list.clear();
+}
+
+/* a registered user's ping timer, due at user->nping. Any command from
+ * the user pushes nping back, in which case we just wait until then.
+ * Otherwise the user is pinged, or disconnected if they never answered the
+ * last ping */
+
+void PingTimer(struct timerec* timer, time_t now)
+{
+	userrec* user = (userrec*)timer->data;
+
+	if (now < user->nping)
+	{
+		AddTimer(&user->pingtimer,user->nping,PingTimer,user);
+		return;
+	}
+	if (!user->lastping)
 	{
+		debug("InspIRCd: ping timeout: %s",user->nick);
+		kill_link(user,"Ping timeout");
 		return;
 	}
-        debug("InspIRCd: processing: %s %s",user->nick,cmd);
-	process_command(user,cmd);
+	Write(user->fd,"PING :%s",ServerName);
+	debug("InspIRCd: pinging: %s",user->nick);
+	user->lastping = 0;
+	user->nping = now+120;
+	AddTimer(&user->pingtimer,user->nping,PingTimer,user);
+}
+
+/* disconnects a client which hasn't completed USER and NICK in time */
+
+void RegTimer(struct timerec* timer, time_t now)
+{
+	userrec* user = (userrec*)timer->data;
+
+	if (user->registered != 7)
+	{
+		debug("InspIRCd: registration timeout: %s",user->nick);
+		kill_link(user,"Registration timeout");
+	}
+}
+
+/* watches a listener again after it was taken out of the socket engine
+ * because there were no fds left to accept with */
+
+void ListenTimer(struct timerec* timer, time_t now)
+{
+	debug("InspIRCd: listening again on fd %d",(int)(long)timer->data);
+	SE->AddFd((int)(long)timer->data,X_LISTEN);
 }
 
 int InspIRCd(void)
 {
   struct sockaddr_in client, server;
-  int portCount = 0, ports[MAXSOCKS];
+  int portCount = 0, ports[MAXSOCKS], boundPorts[MAXSOCKS];
+  int backlogs[MAXSOCKS], reuseports[MAXSOCKS], deferaccepts[MAXSOCKS], nodelays[MAXSOCKS];
   char addrs[MAXBUF][255];
   int openSockfd[MAXSOCKS], incomingSockfd, result = TRUE;
   socklen_t length;
   int count = 0, scanDetectTrigger = TRUE, showBanner = FALSE;
-  int selectResult = 0;
   char *temp, configToken[MAXBUF], stuff[MAXBUF], Addr[MAXBUF];
   char resolvedHost[MAXBUF];
-  fd_set selectFds;
+  vector<sockevent> events;
+  vector<sockop> accepts;
+  vector<int> readable;
   struct timeval tv;
-  int count2;
+  time_t next;
 
   debug("InspIRCd: startup: begin");
   debug("$Id: inspircd.cpp,v 1.31 2003/01/14 00:46:02 brain Exp $");
@@ -3322,6 +4289,20 @@ int InspIRCd(void)
 	ConfValue("bind","address",count,Addr);
 	ports[count] = atoi(configToken);
 	strcpy(addrs[count],Addr);
+	/* the options below are optional, and ConfValue() leaves the
+	 * buffer alone when a value is missing */
+	strcpy(configToken,"");
+	ConfValue("bind","backlog",count,configToken);
+	backlogs[count] = atoi(configToken) > 0 ? atoi(configToken) : SOMAXCONN;
+	strcpy(configToken,"");
+	ConfValue("bind","reuse",count,configToken);
+	reuseports[count] = !strcmp(configToken,"yes");
+	strcpy(configToken,"");
+	ConfValue("bind","deferaccept",count,configToken);
+	deferaccepts[count] = atoi(configToken);
+	strcpy(configToken,"");
+	ConfValue("bind","nodelay",count,configToken);
+	nodelays[count] = !strcmp(configToken,"yes");
 	debug("InspIRCd: startup: read binding %s:%d from config",addrs[count],ports[count]);
   }
   portCount = ConfValueEnum("bind");
@@ -3373,9 +4354,20 @@ int InspIRCd(void)
   }
   
   
-  /* setup select call */
-  FD_ZERO(&selectFds);
-  debug("InspIRCd: startup: zero selects");
+  /* the engine is created after DaemonSeed() so that its handle belongs
+   * to the daemonised process and not to the parent we forked from */
+  SE = CreateSocketEngine(RaiseFdLimit(),SocketEngineName);
+  debug("InspIRCd: startup: %s socket engine, %d descriptors",SE->GetName(),SE->GetMaxFds());
+  fd_ref_table.resize(SE->GetMaxFds(),NULL);
+
+  if ((count = ResolverInit(DNSServer,DNSPort,DNSTimeout,DNSCacheSize)) >= 0)
+  {
+	  SE->AddFd(count,X_RESOLVER);
+  }
+  else
+  {
+	  debug("InspIRCd: startup: no resolver, clients will not be resolved");
+  }
 
   for (count = 0; count < portCount; count++)
   {
@@ -3384,18 +4376,22 @@ int InspIRCd(void)
 	  debug("InspIRCd: startup: bad fd %d",openSockfd[boundPortCount]);
 	  return(ERROR);
       }
-      if (BindSocket(openSockfd[boundPortCount],client,server,ports[count],addrs[count]) == ERROR)
+      ListenOptions(openSockfd[boundPortCount],reuseports[count],deferaccepts[count],nodelays[count]);
+      if (BindSocket(openSockfd[boundPortCount],client,server,ports[count],addrs[count],backlogs[count]) == ERROR)
       {
 	  debug("InspIRCd: startup: failed to bind port %d",ports[count]);
       }
       else			/* well we at least bound to one socket so we'll continue */
       {
+	  NonBlocking(openSockfd[boundPortCount]);
+	  SE->AddFd(openSockfd[boundPortCount],X_LISTEN);
+	  boundPorts[boundPortCount] = ports[count];
 	  boundPortCount++;
       }
   }
 
   debug("InspIRCd: startup: total bound ports %d",boundPortCount);
-  
+
   /* if we didn't bind to anything then abort */
   if (boundPortCount == 0)
   {
@@ -3403,145 +4399,131 @@ int InspIRCd(void)
      return (ERROR);
   }
 
-  length = sizeof (client);
-
-  /* main loop for multiplexing/resetting */
+  /* main loop for multiplexing/resetting. The socket engine only hands
+   * back descriptors which are ready, so idle clients cost us nothing and
+   * we sleep inside Wait() until there is something to do */
   for (;;)
   {
-      /* set up select call */
-      for (count = 0; count < boundPortCount; count++)
-      {
-		FD_SET (openSockfd[count], &selectFds);
-      }
-      /* added timeout! select was waiting forever... wank... :/ */
-      tv.tv_sec = 0;
-      tv.tv_usec = 1;
-      selectResult = select(MAXSOCKS, &selectFds, NULL, NULL, &tv);
+	gettimeofday(&tv,NULL);
+	RunTimers(tv.tv_sec);
+
+	/* sleep until there is I/O to do or the next timer is due */
+	FlushWrites();
+	next = NextTimer(tv.tv_sec);
+	if ((!run_list.empty()) || (ListReady()))
+	{
+		/* users have lines or a LIST waiting, just see what else is ready */
+		SE->Wait(events,0);
+	}
+	else
+	{
+		SE->Wait(events,next ? (next - tv.tv_sec) * 1000 - tv.tv_usec / 1000 : -1);
+	}
 
-  	for (user_hash::iterator count2 = clientlist.begin(); count2 != clientlist.end(); count2++)
+	for (unsigned int e = 0; e < events.size(); e++)
 	{
-		char data[MAXBUF];
+		int fd = events[e].fd;
 
-		if (!count2->second) break;
-		
-		if (count2->second)
-		if ((count2->second->fd))
+		if (events[e].type == X_LISTEN)
 		{
-			if (((time(NULL)) > count2->second->nping) && (isnick(count2->second->nick)) && (count2->second->registered == 7))
+			char target[MAXBUF];
+
+			for (count = 0; count < boundPortCount; count++)
 			{
-				if (!count2->second->lastping) 
+				if (openSockfd[count] == fd)
 				{
-				  	debug("InspIRCd: ping timeout: %s",count2->second->nick);
-					kill_link(count2->second,"Ping timeout");
 					break;
 				}
-				Write(count2->second->fd,"PING :%s",ServerName);
-			  	debug("InspIRCd: pinging: %s",count2->second->nick);
-				count2->second->lastping = 0;
-				count2->second->nping = time(NULL)+120;
-			}
-			
-			result = read(count2->second->fd, data, 1);
-			// result == 0 means nothing read
-			if (result == EAGAIN)
-			{
-			}
-			if (result == ENOTSOCK)
-			{
-			  	debug("InspIRCd: dead socket: %s",count2->second->nick);
-				kill_link(count2->second,"Dead socket");
 			}
-			if (result == ENETUNREACH)
+			if (count == boundPortCount)
 			{
-			  	debug("InspIRCd: network unreachable: %s",count2->second->nick);
-				kill_link(count2->second,"Network unreachable");
+				continue;
 			}
-			if (result == ETIMEDOUT)
+
+			/* drain the accept queue, up to MAXACCEPT at a time so that
+			 * a connect storm can't starve everyone else. Anything left
+			 * is still pending next time round */
+			accepts.resize(MAXACCEPT);
+			for (int n = 0; n < MAXACCEPT; n++)
 			{
-			  	debug("InspIRCd: connection timed out: %s",count2->second->nick);
-				kill_link(count2->second,"Connection timed out");
+				memset(&accepts[n],0,sizeof(sockop));
+				accepts[n].type = OP_ACCEPT;
+				accepts[n].fd = fd;
 			}
-			if (result == ECONNRESET)
+			SE->Submit(accepts);
+
+			/* every op in the batch is looked at even after one has
+			 * failed, an engine may still have accepted more after it
+			 * and those fds would leak. Opers hear about the first
+			 * failure only */
+			int warned = 0;
+			int nofds = 0;
+			for (int n = 0; n < MAXACCEPT; n++)
 			{
-			  	debug("InspIRCd: connection reset: %s",count2->second->nick);
-				kill_link(count2->second,"Connection reset by peer");
+				incomingSockfd = accepts[n].result;
+				if (incomingSockfd < 0)
+				{
+					if ((incomingSockfd != -EAGAIN) && (incomingSockfd != -ECONNABORTED) && (incomingSockfd != -EINTR) && (!warned))
+					{
+						WriteOpers("*** WARNING: Accept failed on port %d (%s)", boundPorts[count],strerror(-incomingSockfd));
+						debug("InspIRCd: accept failed: %d",boundPorts[count]);
+						warned = 1;
+					}
+					if ((incomingSockfd == -EMFILE) || (incomingSockfd == -ENFILE))
+					{
+						nofds = 1;
+					}
+					continue;
+				}
+
+				/* the hostname comes later, from the resolver or its cache */
+				SafeStrncpy (target, (char *) inet_ntoa (accepts[n].addr.sin_addr), MAXBUF);
+				AddClient(incomingSockfd, target,boundPorts[count]);
+				debug("InspIRCd: adding client on port %d fd=%d",boundPorts[count],incomingSockfd);
 			}
-			else if (result < -1)
+			if (nofds)
 			{
+				/* the connection is still waiting, so the listener
+				 * stays readable and every pass would fail the same
+				 * way. Stop watching it for a second instead of
+				 * spinning */
+				SE->DelFd(fd);
+				AddTimer(&listen_pause[count],time(NULL)+1,ListenTimer,(void*)(long)fd);
 			}
-			else if (result > 0)
+		}
+		else if (events[e].type == X_RESOLVER)
+		{
+			ResolverRead();
+		}
+		else if (events[e].type == X_ESTAB_CLIENT)
+		{
+			userrec* user = fd_to_user(fd);
+
+			if ((user) && (events[e].flags & EVENT_WRITE))
 			{
-				if ((data) && (count2->second->inbuf) && (count2->second->fd) && (count2->second))
+				if (FlushClient(user) < 0)
 				{
-					strncat(count2->second->inbuf, data, result);
-					if (strstr(count2->second->inbuf, "\n") || strstr(count2->second->inbuf, "\r"))
-					{
-						/* at least one complete line is waiting to be processed */
-						if (count2->second->fd == 0)
-						{
-							break;
-						}
-						if (count2->second->fd)
-						{
-							process_buffer(count2->second);
-							break;
-						}
-					}
+					kill_link(user,strerror(errno));
+					continue;
 				}
 			}
+			if ((user) && (events[e].flags & (EVENT_READ | EVENT_ERROR)))
+			{
+				readable.push_back(fd);
+			}
 		}
 	}
-
-      /* something blew up */
-      if (selectResult < 0)
-      {
-      }
-      if (selectResult == 0)
-      {
-      }
-      /* select is reporting a waiting socket. Poll them all to find out which */
-      else if (selectResult > 0)
-      {
-	for (count = 0; count < boundPortCount; count++)		
-        {
-	    if (FD_ISSET (openSockfd[count], &selectFds))
-            {
-	      char target[MAXBUF];
-              incomingSockfd = accept (openSockfd[count], (struct sockaddr *) &client, &length);
-	      
-              address_cache::iterator iter = IP.find(client.sin_addr);
-	      bool iscached = false;
-              if (iter == IP.end())
-              {
-                        /* ip isn't in cache, add it */
-                        SafeStrncpy (target, (char *) inet_ntoa (client.sin_addr), MAXBUF);
-                        /* hostname now in 'target' */
-                        IP[client.sin_addr] = new string(target);
-			/* hostname in cache */
-              }
-              else
-              {
-			/* found ip (cached) */
-	                SafeStrncpy(target, iter->second->c_str(), MAXBUF);
-			iscached = true;
-	      }
-
-	      if (incomingSockfd < 0)
-	      {
-	        WriteOpers("*** WARNING: Accept failed on port %d (%s)", ports[count],target);
-	  	debug("InspIRCd: accept failed: %d",ports[count]);
-	        break;
-	      }
-	      AddClient(incomingSockfd, target,ports[count],iscached);
-  	      debug("InspIRCd: adding client on port %d fd=%d",ports[count],incomingSockfd);
-	      break;
-	    }
-
+	/* users who were waiting get their turn before anyone who has only
+	 * just sent something, so nobody gets two turns in one pass */
+	RunCommands();
+	ListChannels();
+	if (!readable.empty())
+	{
+		ReadClients(readable);
+		readable.clear();
 	}
-      }
   }
 
   /* not reached */
   close (incomingSockfd);
 }
-
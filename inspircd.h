@@ -37,8 +37,23 @@ Added methods to Server class
 #define ERROR -1
 #define TRUE 1
 #define FALSE 0
-/* max sockets we can open */
+/* max listening ports we can bind */
 #define MAXSOCKS 64
+/* max connections accepted from one listener per pass of the main loop */
+#define MAXACCEPT 64
+/* reads handed to the socket engine at once, and the size of each */
+#define READBATCH 64
+#define READSIZE 16384
+/* most sendQ lines gathered into one writev */
+#define WRITEBATCH 64
+/* channels looked at per turn of a LIST, and the sendQ size below which
+ * the next turn is given, see ListChannels() */
+#define LISTBATCH 256
+#define LISTROOM 8192
+/* most bytes of numerics gathered into one sendQ line, see batch_serv() */
+#define BATCHSIZE 4096
+/* most replies a WHO for a mask will give */
+#define WHOLIMIT 500
 
 /* prototypes */
 int InspIRCd(void);
@@ -61,9 +76,18 @@ extern "C" void WriteCommon(struct userrec *u, char* text, ...);
 extern "C" void WriteCommonExcept(struct userrec *u, char* text, ...);
 extern "C" void WriteWallOps(struct userrec *source, char* text, ...);
 extern "C" int isnick(const char *n);
-extern "C" struct userrec* Find(string nick);
+int ischan(const char *n);
+extern "C" struct userrec* Find(const char* nick);
 extern "C" struct chanrec* FindChan(const char* chan);
 extern "C" char* cmode(struct userrec *user, struct chanrec *chan);
+extern "C" int usercount(struct chanrec *c);
+extern "C" int usercnt(void);
+extern "C" int usercount_invisible(void);
+extern "C" int usercount_opers(void);
+extern "C" int usercount_unknown(void);
+extern "C" int usercount_max(void);
+extern "C" int chancount(void);
+extern "C" int servercount(void);
 extern "C" string getservername();
 extern "C" string getnetworkname();
 extern "C" string getadminname();
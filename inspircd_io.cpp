@@ -33,6 +33,7 @@
 #include "inspircd.h"
 #include "inspircd_io.h"
 #include "inspircd_util.h"
+#include <netinet/tcp.h>
 
 extern "C" void WriteOpers(char* text, ...);
 
@@ -293,7 +294,7 @@ int ConfValue(char* tag, char* var, int index, char *result)
 
 
 /* This will bind a socket to a port. It works for UDP/TCP */
-int BindSocket (int sockfd, struct sockaddr_in client, struct sockaddr_in server, int port, char* addr)
+int BindSocket (int sockfd, struct sockaddr_in client, struct sockaddr_in server, int port, char* addr, int backlog)
 {
   bzero((char *)&server,sizeof(server));
   struct in_addr addy;
@@ -317,12 +318,43 @@ int BindSocket (int sockfd, struct sockaddr_in client, struct sockaddr_in server
   }
   else
   {
-    listen(sockfd,5);
+    if (listen(sockfd,backlog) < 0)
+    {
+      return(ERROR);
+    }
     return(TRUE);
   }
 }
 
 
+/* Sets the <bind> tag options on a listening socket, must be called before
+ * BindSocket(). Options the system doesn't support are quietly skipped */
+void ListenOptions (int sockfd, int reuseport, int deferaccept, int nodelay)
+{
+  int on = 1;
+
+#ifdef SO_REUSEPORT
+  if (reuseport)
+  {
+    /* lets several processes share the port, the kernel spreads connections between them */
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (const char*)&on, sizeof(on));
+  }
+#endif
+#ifdef TCP_DEFER_ACCEPT
+  if (deferaccept)
+  {
+    /* don't wake us for a connection until the client has sent something */
+    setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, (const char*)&deferaccept, sizeof(deferaccept));
+  }
+#endif
+  if (nodelay)
+  {
+    /* inherited by every connection accepted from this socket */
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+  }
+}
+
+
 /* Open a TCP Socket */
 int OpenTCPSocket (void)
 {
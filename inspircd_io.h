@@ -27,6 +27,7 @@ void Start (void);
 int DaemonSeed (void); 
 int CheckConfig (void); 
 int OpenTCPSocket (void); 
-int BindSocket (int sockfd, struct sockaddr_in client, struct sockaddr_in server, int port, char* addr);
+int BindSocket (int sockfd, struct sockaddr_in client, struct sockaddr_in server, int port, char* addr, int backlog);
+void ListenOptions (int sockfd, int reuseport, int deferaccept, int nodelay);
 int ConfValue(char* tag, char* var, int index, char *result);
 int ConfValueEnum(char* tag);
@@ -22,6 +22,7 @@ Version::Version(int major, int minor, int revision, int build) : Major(major),
 // admin is a simple class for holding a server's administrative info
 
 Admin::Admin(string name, string email, string nick) : Name(name), Email(email), Nick(nick) { };
+ServerStats::ServerStats(int users, int invisible, int opers, int unknown, int channels, int maxusers) : Users(users), Invisible(invisible), Opers(opers), Unknown(unknown), Channels(channels), MaxUsers(maxusers) { };
 
 //
 // Announce to the world that the Module base
@@ -119,7 +120,7 @@ bool Server::IsNick(string nick)
 
 userrec* Server::FindNick(string nick)
 {
-	return Find(nick);
+	return Find(nick.c_str());
 }
 
 chanrec* Server::FindChannel(string channel)
@@ -133,6 +134,11 @@ string Server::ChanMode(userrec* User, chanrec* Chan)
 	return mode;
 }
 
+int Server::CountUsers(chanrec* Chan)
+{
+	return usercount(Chan);
+}
+
 string Server::GetServerName()
 {
 	return getservername();
@@ -148,4 +154,9 @@ Admin Server::GetAdmin()
 	return Admin(getadminname(),getadminemail(),getadminnick());
 }
 
+ServerStats Server::GetStats()
+{
+	return ServerStats(usercnt(),usercount_invisible(),usercount_opers(),usercount_unknown(),chancount(),usercount_max());
+}
+
 
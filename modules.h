@@ -37,6 +37,15 @@ class Admin
 	 Admin(string name,string email,string nick);
 };
 
+// ServerStats holds the numbers shown by /LUSERS, for modules
+
+class ServerStats
+{
+ public:
+	 const int Users, Invisible, Opers, Unknown, Channels, MaxUsers;
+	 ServerStats(int users,int invisible,int opers,int unknown,int channels,int maxusers);
+};
+
 //
 // Module is an abstract class so that developers can inherit from it
 //
@@ -78,9 +87,11 @@ class Server
 	 virtual userrec* FindNick(string nick);
 	 virtual chanrec* FindChannel(string channel);
 	 virtual string ChanMode(userrec* User, chanrec* Chan);
+	 virtual int CountUsers(chanrec* Chan);
 	 virtual string GetServerName();
 	 virtual string GetNetworkName();
 	 virtual Admin GetAdmin();
+	 virtual ServerStats GetStats();
 	 
 };
 
@@ -0,0 +1,118 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  Inspire is copyright (C) 2002-2003 ChatSpike-Dev.
+ *                       E-mail:
+ *                <brain@chatspike.net>
+ *           	  <Craig@chatspike.net>
+ *
+ * Written by Craig Edwards, Craig McLure, and others.
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd.h"
+#include "siphash.h"
+#include "casemap.h"
+#include <fcntl.h>
+#include <sys/time.h>
+
+/* the nick, channel and address tables hash with SipHash under a key
+ * picked at random when the server starts. Without knowing the key
+ * nobody can work out a set of names which all land in the same place,
+ * so picking nicks or channel names can't be used to make lookups slow */
+
+static unsigned long long k0 = 0, k1 = 0;
+
+void InitHashKey(void)
+{
+	unsigned long long key[2];
+	int fd = open("/dev/urandom",O_RDONLY);
+
+	if ((fd < 0) || (read(fd,key,sizeof(key)) != sizeof(key)))
+	{
+		/* not as good, but better than a fixed key */
+		struct timeval tv;
+
+		gettimeofday(&tv,NULL);
+		key[0] = ((unsigned long long)tv.tv_sec << 32) ^ tv.tv_usec ^ ((unsigned long long)getpid() << 16);
+		key[1] = (unsigned long long)(size_t)&tv ^ (key[0] * 0x9E3779B97F4A7C15ULL);
+	}
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+	k0 = key[0];
+	k1 = key[1];
+}
+
+#define ROTL(x,b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+	v0 += v1; v1 = ROTL(v1,13); v1 ^= v0; v0 = ROTL(v0,32); \
+	v2 += v3; v3 = ROTL(v3,16); v3 ^= v2; \
+	v0 += v3; v3 = ROTL(v3,21); v3 ^= v0; \
+	v2 += v1; v1 = ROTL(v1,17); v1 ^= v2; v2 = ROTL(v2,32)
+
+/* the next eight bytes of data as a little endian word */
+
+static inline unsigned long long load_word(const unsigned char* p)
+{
+	unsigned long long m;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	memcpy(&m,p,8);
+#else
+	m = 0;
+	for (int b = 7; b >= 0; b--)
+	{
+		m = (m << 8) | p[b];
+	}
+#endif
+	return m;
+}
+
+unsigned long long KeyedHash(const unsigned char* data, size_t len, int fold)
+{
+	unsigned long long v0 = k0 ^ 0x736f6d6570736575ULL;
+	unsigned long long v1 = k1 ^ 0x646f72616e646f6dULL;
+	unsigned long long v2 = k0 ^ 0x6c7967656e657261ULL;
+	unsigned long long v3 = k1 ^ 0x7465646279746573ULL;
+	unsigned long long m;
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8)
+	{
+		m = load_word(data + i);
+		if (fold)
+		{
+			m = fold_word(m);
+		}
+		v3 ^= m;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	/* the last few bytes, with the length in the top byte */
+	m = 0;
+	for (int b = len - i - 1; b >= 0; b--)
+	{
+		m |= (unsigned long long)data[i+b] << (8 * b);
+	}
+	if (fold)
+	{
+		m = fold_word(m);
+	}
+	m |= (unsigned long long)len << 56;
+	v3 ^= m;
+	SIPROUND;
+	v0 ^= m;
+
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
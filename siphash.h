@@ -0,0 +1,33 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  Inspire is copyright (C) 2002-2003 ChatSpike-Dev.
+ *                       E-mail:
+ *                <brain@chatspike.net>
+ *           	  <Craig@chatspike.net>
+ *
+ * Written by Craig Edwards, Craig McLure, and others.
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include <stddef.h>
+
+#ifndef __SIPHASH_H__
+#define __SIPHASH_H__
+
+/* picks the secret key for the hashes below. Must be called once at
+ * startup, before anything is put in a table which uses them */
+
+void InitHashKey(void);
+
+/* SipHash-1-3 of len bytes. If fold is nonzero the bytes are folded to
+ * lower case as they are read (see casemap.h), so a table which ignores
+ * case can hash a name without copying it */
+
+unsigned long long KeyedHash(const unsigned char* data, size_t len, int fold);
+
+#endif
@@ -0,0 +1,1081 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  Inspire is copyright (C) 2002-2003 ChatSpike-Dev.
+ *                       E-mail:
+ *                <brain@chatspike.net>
+ *           	  <Craig@chatspike.net>
+ *
+ * Written by Craig Edwards, Craig McLure, and others.
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd.h"
+#include "socketengine.h"
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <fcntl.h>
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef USE_IOURING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+using namespace std;
+
+SocketEngine::SocketEngine(int maxfds) : ref(maxfds,X_EMPTY_SLOT), writing(maxfds,0), MaxFds(maxfds), CurrentFds(0)
+{
+}
+
+SocketEngine::~SocketEngine()
+{
+}
+
+int SocketEngine::GetType(int fd)
+{
+	if ((fd < 0) || (fd >= MaxFds))
+	{
+		return X_EMPTY_SLOT;
+	}
+	return ref[fd];
+}
+
+int SocketEngine::GetMaxFds()
+{
+	return MaxFds;
+}
+
+int SocketEngine::GetCurrentFds()
+{
+	return CurrentFds;
+}
+
+/* accepts one connection, non-blocking and close-on-exec, or returns -errno */
+
+static int AcceptOne(int fd, struct sockaddr_in* addr)
+{
+	socklen_t length = sizeof(struct sockaddr_in);
+	int newfd;
+
+#ifdef SOCK_NONBLOCK
+	newfd = accept4(fd, (struct sockaddr*)addr, &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	newfd = accept(fd, (struct sockaddr*)addr, &length);
+	if (newfd >= 0)
+	{
+		fcntl(newfd, F_SETFL, fcntl(newfd, F_GETFL, 0) | O_NONBLOCK);
+		fcntl(newfd, F_SETFD, FD_CLOEXEC);
+	}
+#endif
+	return (newfd < 0) ? -errno : newfd;
+}
+
+/* the readiness based engines just make one system call per operation.
+ * Once an accept on a listener fails (it would block, or there are no fds
+ * left) the rest of the accepts on it are skipped rather than each costing
+ * a wasted call */
+
+void SocketEngine::Submit(vector<sockop> &ops)
+{
+	for (unsigned int i = 0; i < ops.size(); i++)
+	{
+		sockop &op = ops[i];
+		switch (op.type)
+		{
+			case OP_ACCEPT:
+				if ((i) && (ops[i-1].type == OP_ACCEPT) && (ops[i-1].fd == op.fd) && (ops[i-1].result < 0))
+				{
+					op.result = -EAGAIN;
+					break;
+				}
+				op.result = AcceptOne(op.fd,&op.addr);
+			break;
+			case OP_READ:
+				op.result = read(op.fd,op.buf,op.len);
+				if (op.result < 0)
+				{
+					op.result = -errno;
+				}
+			break;
+			case OP_WRITEV:
+				op.result = writev(op.fd,op.iov,op.iovcnt);
+				if (op.result < 0)
+				{
+					op.result = -errno;
+				}
+			break;
+			default:
+				op.result = -EINVAL;
+			break;
+		}
+	}
+}
+
+/* select() could only ever see the first FD_SETSIZE descriptors, the
+ * engines below have no such limit so take as many as the system allows */
+
+int RaiseFdLimit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE,&rl) < 0)
+	{
+		return MAXCLIENTS+64;
+	}
+	if (rl.rlim_cur != rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE,&rl);
+		getrlimit(RLIMIT_NOFILE,&rl);
+	}
+	if ((rl.rlim_cur == RLIM_INFINITY) || (rl.rlim_cur > 1048576))
+	{
+		return 1048576;
+	}
+	return rl.rlim_cur;
+}
+
+#ifdef USE_EPOLL
+
+/* linux epoll(7), the kernel keeps the interest list so each Wait() only
+ * costs as much as the number of descriptors that are actually ready */
+
+class EPollEngine : public SocketEngine
+{
+	int EngineHandle;
+	vector<struct epoll_event> events;
+ public:
+	EPollEngine(int maxfds);
+	virtual ~EPollEngine();
+	virtual bool AddFd(int fd, int type);
+	virtual bool DelFd(int fd);
+	virtual bool WantWrite(int fd, bool want);
+	virtual int Wait(vector<sockevent> &ready, int timeout);
+	virtual const char* GetName();
+	bool Ok();
+};
+
+EPollEngine::EPollEngine(int maxfds) : SocketEngine(maxfds), events(1024)
+{
+	EngineHandle = epoll_create(maxfds);
+	debug("EPollEngine: handle %d, max fds %d",EngineHandle,maxfds);
+}
+
+EPollEngine::~EPollEngine()
+{
+	if (EngineHandle >= 0)
+	{
+		close(EngineHandle);
+	}
+}
+
+bool EPollEngine::Ok()
+{
+	return (EngineHandle >= 0);
+}
+
+bool EPollEngine::AddFd(int fd, int type)
+{
+	struct epoll_event ev;
+
+	if ((fd < 0) || (fd >= MaxFds) || (ref[fd] != X_EMPTY_SLOT))
+	{
+		return false;
+	}
+	memset(&ev,0,sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(EngineHandle, EPOLL_CTL_ADD, fd, &ev) < 0)
+	{
+		debug("EPollEngine: can't add fd %d: %s",fd,strerror(errno));
+		return false;
+	}
+	ref[fd] = type;
+	CurrentFds++;
+	return true;
+}
+
+bool EPollEngine::DelFd(int fd)
+{
+	struct epoll_event ev;
+
+	if ((fd < 0) || (fd >= MaxFds) || (ref[fd] == X_EMPTY_SLOT))
+	{
+		return false;
+	}
+	memset(&ev,0,sizeof(ev));
+	epoll_ctl(EngineHandle, EPOLL_CTL_DEL, fd, &ev);
+	ref[fd] = X_EMPTY_SLOT;
+	writing[fd] = 0;
+	CurrentFds--;
+	return true;
+}
+
+bool EPollEngine::WantWrite(int fd, bool want)
+{
+	struct epoll_event ev;
+
+	if ((fd < 0) || (fd >= MaxFds) || (ref[fd] == X_EMPTY_SLOT))
+	{
+		return false;
+	}
+	if (writing[fd] == want)
+	{
+		return true;
+	}
+	memset(&ev,0,sizeof(ev));
+	ev.events = want ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(EngineHandle, EPOLL_CTL_MOD, fd, &ev) < 0)
+	{
+		debug("EPollEngine: can't modify fd %d: %s",fd,strerror(errno));
+		return false;
+	}
+	writing[fd] = want;
+	return true;
+}
+
+int EPollEngine::Wait(vector<sockevent> &ready, int timeout)
+{
+	int n = epoll_wait(EngineHandle, &events[0], events.size(), timeout);
+
+	ready.clear();
+	for (int i = 0; i < n; i++)
+	{
+		sockevent s;
+		s.fd = events[i].data.fd;
+		s.type = GetType(s.fd);
+		s.flags = 0;
+		if (events[i].events & EPOLLIN)
+			s.flags |= EVENT_READ;
+		if (events[i].events & EPOLLOUT)
+			s.flags |= EVENT_WRITE;
+		if (events[i].events & (EPOLLERR | EPOLLHUP))
+			s.flags |= EVENT_ERROR;
+		ready.push_back(s);
+	}
+	/* a full batch means there is probably more waiting, grow for next time */
+	if ((n == (int)events.size()) && (events.size() < (unsigned)MaxFds))
+	{
+		events.resize(events.size() * 2);
+	}
+	return n;
+}
+
+const char* EPollEngine::GetName()
+{
+	return "epoll";
+}
+
+#endif
+
+#ifdef USE_IOURING
+
+/* linux io_uring(7), completion based. Readiness is still how the main loop
+ * finds work, but instead of a system call per socket per operation every
+ * poll change, and every batch of reads or writes handed to Submit(), goes
+ * to the kernel in a single io_uring_enter(). Listeners use multishot
+ * accept, so new connections are waiting for us by the time the listener
+ * is reported. There is no liburing dependency, the rings are mapped here */
+
+/* what a completion is for, kept in the top byte of its user_data */
+
+#define UD_POLL		1ULL
+#define UD_ACCEPT	2ULL
+#define UD_OP		3ULL
+#define UD_CANCEL	4ULL
+
+#define UD(kind,gen,fd) (((kind) << 56) | (((unsigned long long)(gen) & 0xffffff) << 32) | (unsigned int)(fd))
+
+class IOUringEngine : public SocketEngine
+{
+	int EngineHandle;
+	struct io_uring_params params;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	struct io_uring_sqe* sqes;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+	void* sq_ring;
+	void* cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned pending;		/* sqes queued but not yet submitted */
+
+	vector<unsigned> gen;		/* bumped whenever an fd's poll is replaced, so stale completions are ignored */
+	vector<char> accepting;		/* listener has a multishot accept armed (else it is polled) */
+	vector<vector<int> > accepted;	/* connections accepted by the kernel, waiting for OP_ACCEPT */
+	vector<int> accept_error;	/* why multishot accept stopped, for the next OP_ACCEPT */
+	vector<int> listeners;
+	vector<int> rearm;		/* fds whose one-shot poll fired and needs arming again */
+	vector<sockevent> ready;	/* events picked up outside of Wait() */
+	vector<sockop>* inflight;	/* the batch Submit() is waiting for */
+	unsigned batch;			/* serial of that batch, in the user_data of its ops */
+	int outstanding;
+	bool reaping;			/* inside Reap(), which must not be entered again */
+
+	struct io_uring_sqe* GetSqe();
+	int Enter(unsigned min_complete, int timeout);
+	void Reap();
+	void Complete(struct io_uring_cqe* cqe);
+	void ArmPoll(int fd);
+	void ArmAccept(int fd);
+	void Cancel(unsigned long long user_data);
+	void RunOp(unsigned int i);
+	void Reclaim();
+ public:
+	IOUringEngine(int maxfds);
+	virtual ~IOUringEngine();
+	virtual bool AddFd(int fd, int type);
+	virtual bool DelFd(int fd);
+	virtual bool WantWrite(int fd, bool want);
+	virtual int Wait(vector<sockevent> &events, int timeout);
+	virtual void Submit(vector<sockop> &ops);
+	virtual const char* GetName();
+	bool Ok();
+};
+
+IOUringEngine::IOUringEngine(int maxfds) : SocketEngine(maxfds), sqes((struct io_uring_sqe*)MAP_FAILED), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), pending(0), gen(maxfds,0), accepting(maxfds,0), accepted(maxfds), accept_error(maxfds,0), inflight(NULL), batch(0), outstanding(0), reaping(false)
+{
+	char* sq;
+	char* cq;
+
+	memset(&params,0,sizeof(params));
+	/* a big completion ring, every socket can have a poll completion
+	 * waiting at the same time as a full batch of operations */
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = 65536;
+	EngineHandle = syscall(__NR_io_uring_setup, 4096, &params);
+	if (EngineHandle < 0)
+	{
+		debug("IOUringEngine: io_uring_setup failed: %s",strerror(errno));
+		return;
+	}
+	if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+	{
+		/* we need a timeout on io_uring_enter(), and must never lose a completion */
+		debug("IOUringEngine: kernel too old, missing EXT_ARG or NODROP");
+		close(EngineHandle);
+		EngineHandle = -1;
+		return;
+	}
+
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		sq_ring_size = cq_ring_size = (sq_ring_size > cq_ring_size) ? sq_ring_size : cq_ring_size;
+	}
+	sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_SQ_RING);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		cq_ring = sq_ring;
+	}
+	else
+	{
+		cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_CQ_RING);
+	}
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = (struct io_uring_sqe*)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_SQES);
+	if ((sq_ring == MAP_FAILED) || (cq_ring == MAP_FAILED) || (sqes == MAP_FAILED))
+	{
+		debug("IOUringEngine: can't map rings: %s",strerror(errno));
+		close(EngineHandle);
+		EngineHandle = -1;
+		return;
+	}
+
+	sq = (char*)sq_ring;
+	cq = (char*)cq_ring;
+	sq_head = (unsigned*)(sq + params.sq_off.head);
+	sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	sq_array = (unsigned*)(sq + params.sq_off.array);
+	cq_head = (unsigned*)(cq + params.cq_off.head);
+	cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	debug("IOUringEngine: handle %d, %d sq entries, %d cq entries, max fds %d",EngineHandle,params.sq_entries,params.cq_entries,maxfds);
+}
+
+IOUringEngine::~IOUringEngine()
+{
+	if (sqes != MAP_FAILED)
+		munmap(sqes, sqes_size);
+	if ((cq_ring != MAP_FAILED) && (cq_ring != sq_ring))
+		munmap(cq_ring, cq_ring_size);
+	if (sq_ring != MAP_FAILED)
+		munmap(sq_ring, sq_ring_size);
+	if (EngineHandle >= 0)
+		close(EngineHandle);
+}
+
+bool IOUringEngine::Ok()
+{
+	return (EngineHandle >= 0);
+}
+
+/* returns a zeroed sqe to fill in. If the submission ring is full what is
+ * already queued is pushed to the kernel first. The kernel can refuse it
+ * (EBUSY while completions are backed up), so then the completions are
+ * collected and it is tried once more. Returns NULL if there is still no
+ * room, in which case the caller must give up on the operation */
+
+struct io_uring_sqe* IOUringEngine::GetSqe()
+{
+	unsigned tail = *sq_tail;
+	struct io_uring_sqe* sqe;
+
+	for (int tries = 0; tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= params.sq_entries; tries++)
+	{
+		if (tries == 2)
+		{
+			debug("IOUringEngine: submission ring full");
+			return NULL;
+		}
+		if (tries)
+		{
+			Reap();
+		}
+		Enter(0,0);
+	}
+	sqe = &sqes[tail & *sq_mask];
+	memset(sqe,0,sizeof(struct io_uring_sqe));
+	sq_array[tail & *sq_mask] = tail & *sq_mask;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	pending++;
+	return sqe;
+}
+
+/* submits everything queued and, if min_complete is set, waits up to
+ * timeout ms (forever if negative) for that many completions */
+
+int IOUringEngine::Enter(unsigned min_complete, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = IORING_ENTER_EXT_ARG;
+	int result;
+
+	memset(&arg,0,sizeof(arg));
+	if (min_complete)
+	{
+		flags |= IORING_ENTER_GETEVENTS;
+		if (timeout >= 0)
+		{
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000LL;
+			arg.ts = (unsigned long long)&ts;
+		}
+	}
+	do
+	{
+		result = syscall(__NR_io_uring_enter, EngineHandle, pending, min_complete, flags, &arg, sizeof(arg));
+	} while ((result < 0) && (errno == EINTR) && (!min_complete));
+
+	if (result >= 0)
+	{
+		pending -= (unsigned)result > pending ? pending : result;
+	}
+	else if ((errno != ETIME) && (errno != EINTR) && (errno != EBUSY))
+	{
+		debug("IOUringEngine: io_uring_enter: %s",strerror(errno));
+	}
+	return result;
+}
+
+void IOUringEngine::ArmPoll(int fd)
+{
+	struct io_uring_sqe* sqe = GetSqe();
+	if (!sqe)
+	{
+		/* try again at the start of the next Wait() */
+		rearm.push_back(fd);
+		return;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = writing[fd] ? (POLLIN | POLLOUT) : POLLIN;
+	sqe->user_data = UD(UD_POLL,gen[fd],fd);
+}
+
+void IOUringEngine::ArmAccept(int fd)
+{
+	struct io_uring_sqe* sqe = GetSqe();
+	if (!sqe)
+	{
+		/* poll the listener instead, like a kernel without multishot accept */
+		accepting[fd] = 0;
+		gen[fd]++;
+		rearm.push_back(fd);
+		return;
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = UD(UD_ACCEPT,gen[fd],fd);
+}
+
+void IOUringEngine::Cancel(unsigned long long user_data)
+{
+	struct io_uring_sqe* sqe = GetSqe();
+	if (!sqe)
+	{
+		/* the generation has been bumped, so whatever it would
+		 * have cancelled is ignored when it completes */
+		return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->user_data = UD(UD_CANCEL,0,0);
+}
+
+bool IOUringEngine::AddFd(int fd, int type)
+{
+	if ((fd < 0) || (fd >= MaxFds) || (ref[fd] != X_EMPTY_SLOT))
+	{
+		return false;
+	}
+	ref[fd] = type;
+	gen[fd]++;
+	if (type == X_LISTEN)
+	{
+		accepting[fd] = 1;
+		listeners.push_back(fd);
+		ArmAccept(fd);
+	}
+	else
+	{
+		ArmPoll(fd);
+	}
+	CurrentFds++;
+	return true;
+}
+
+bool IOUringEngine::DelFd(int fd)
+{
+	if ((fd < 0) || (fd >= MaxFds) || (ref[fd] == X_EMPTY_SLOT))
+	{
+		return false;
+	}
+	Cancel(UD(accepting[fd] ? UD_ACCEPT : UD_POLL,gen[fd],fd));
+	for (unsigned int i = 0; i < accepted[fd].size(); i++)
+	{
+		close(accepted[fd][i]);
+	}
+	accepted[fd].clear();
+	accept_error[fd] = 0;
+	if (ref[fd] == X_LISTEN)
+	{
+		for (unsigned int i = 0; i < listeners.size(); i++)
+		{
+			if (listeners[i] == fd)
+			{
+				listeners.erase(listeners.begin() + i);
+				break;
+			}
+		}
+	}
+	accepting[fd] = 0;
+	ref[fd] = X_EMPTY_SLOT;
+	writing[fd] = 0;
+	gen[fd]++;
+	CurrentFds--;
+	return true;
+}
+
+bool IOUringEngine::WantWrite(int fd, bool want)
+{
+	if ((fd < 0) || (fd >= MaxFds) || (ref[fd] == X_EMPTY_SLOT))
+	{
+		return false;
+	}
+	if (writing[fd] == want)
+	{
+		return true;
+	}
+	/* replace the poll with one for the new set of events */
+	Cancel(UD(UD_POLL,gen[fd],fd));
+	writing[fd] = want;
+	gen[fd]++;
+	ArmPoll(fd);
+	return true;
+}
+
+/* deals with one completion */
+
+void IOUringEngine::Complete(struct io_uring_cqe* cqe)
+{
+	unsigned long long kind = cqe->user_data >> 56;
+	unsigned g = (cqe->user_data >> 32) & 0xffffff;
+	int fd = cqe->user_data & 0xffffffff;
+
+	if (kind == UD_OP)
+	{
+		/* a completion left over from an earlier batch would land on
+		 * the wrong op, or on one that no longer exists */
+		if ((inflight) && (g == (batch & 0xffffff)) && (fd < (int)inflight->size()) && ((*inflight)[fd].result == -EINPROGRESS))
+		{
+			(*inflight)[fd].result = cqe->res;
+			outstanding--;
+		}
+		return;
+	}
+	if ((kind != UD_POLL) && (kind != UD_ACCEPT))
+	{
+		return;
+	}
+	if ((fd < 0) || (fd >= MaxFds) || (ref[fd] == X_EMPTY_SLOT) || (g != (gen[fd] & 0xffffff)))
+	{
+		/* this fd was removed or its poll replaced since */
+		if ((kind == UD_ACCEPT) && (cqe->res >= 0))
+		{
+			close(cqe->res);
+		}
+		return;
+	}
+
+	if (kind == UD_ACCEPT)
+	{
+		if (cqe->res >= 0)
+		{
+			accepted[fd].push_back(cqe->res);
+		}
+		else if (cqe->res == -EINVAL)
+		{
+			/* no multishot accept on this kernel, poll the listener instead */
+			debug("IOUringEngine: no multishot accept, polling listener %d",fd);
+			accepting[fd] = 0;
+			gen[fd]++;
+			ArmPoll(fd);
+			return;
+		}
+		else if ((cqe->res == -EMFILE) || (cqe->res == -ENFILE))
+		{
+			/* out of fds. Arming it again now would only fail again
+			 * straight away, so pass the error on to the main loop,
+			 * which stops watching the listener for a while */
+			accept_error[fd] = cqe->res;
+			return;
+		}
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+		{
+			/* the kernel stopped accepting (e.g. out of fds), start again */
+			gen[fd]++;
+			ArmAccept(fd);
+		}
+		return;
+	}
+
+	/* a one-shot poll fired. It is armed again at the start of the next
+	 * Wait(), after the main loop has dealt with this event, so that a
+	 * socket with data still waiting is reported again like epoll would */
+	sockevent s;
+	s.fd = fd;
+	s.type = ref[fd];
+	s.flags = 0;
+	if (cqe->res < 0)
+		s.flags |= EVENT_ERROR;
+	else
+	{
+		if (cqe->res & POLLIN)
+			s.flags |= EVENT_READ;
+		if (cqe->res & POLLOUT)
+			s.flags |= EVENT_WRITE;
+		if (cqe->res & (POLLERR | POLLHUP))
+			s.flags |= EVENT_ERROR;
+	}
+	ready.push_back(s);
+	rearm.push_back(fd);
+}
+
+void IOUringEngine::Reap()
+{
+	unsigned head = *cq_head;
+	unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+	if (reaping)
+	{
+		/* Complete() asked for an sqe with the ring full, the
+		 * completions it would collect are already being dealt with */
+		return;
+	}
+	reaping = true;
+	while (head != tail)
+	{
+		Complete(&cqes[head & *cq_mask]);
+		head++;
+		if (head == tail)
+		{
+			__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+			tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		}
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	reaping = false;
+}
+
+int IOUringEngine::Wait(vector<sockevent> &events, int timeout)
+{
+	vector<int> again;
+	bool waiting = false;
+
+	again.swap(rearm);
+	for (unsigned int i = 0; i < again.size(); i++)
+	{
+		if (ref[again[i]] != X_EMPTY_SLOT)
+		{
+			ArmPoll(again[i]);
+		}
+	}
+	for (unsigned int i = 0; (i < listeners.size()) && (!waiting); i++)
+	{
+		waiting = (!accepted[listeners[i]].empty()) || (accept_error[listeners[i]]);
+	}
+
+	/* if something is already waiting, just submit and collect */
+	Enter(((ready.empty()) && (!waiting)) ? 1 : 0, timeout);
+	Reap();
+
+	events.clear();
+	events.swap(ready);
+	for (unsigned int i = 0; i < listeners.size(); i++)
+	{
+		if ((!accepted[listeners[i]].empty()) || (accept_error[listeners[i]]))
+		{
+			sockevent s;
+			s.fd = listeners[i];
+			s.type = X_LISTEN;
+			s.flags = EVENT_READ;
+			events.push_back(s);
+		}
+	}
+	return events.size();
+}
+
+/* queues every read and write in the batch and hands them to the kernel in
+ * one io_uring_enter(). MSG_DONTWAIT makes each complete straight away,
+ * with -EAGAIN if it would have blocked, so the buffers are only in use
+ * until this returns. Accepts are served from what multishot accept has
+ * already collected */
+
+void IOUringEngine::Submit(vector<sockop> &ops)
+{
+	int failures = 0;
+
+	inflight = &ops;
+	batch++;
+	outstanding = 0;
+
+	for (unsigned int i = 0; i < ops.size(); i++)
+	{
+		sockop &op = ops[i];
+		struct io_uring_sqe* sqe;
+
+		switch (op.type)
+		{
+			case OP_ACCEPT:
+				if ((i) && (ops[i-1].type == OP_ACCEPT) && (ops[i-1].fd == op.fd) && (ops[i-1].result < 0))
+				{
+					/* as for the other engines, stop at the first failure */
+					op.result = -EAGAIN;
+				}
+				/* anything multishot accept already collected goes
+				 * first, it may have been given up on since */
+				else if ((op.fd >= 0) && (op.fd < MaxFds) && (!accepted[op.fd].empty()))
+				{
+					socklen_t length = sizeof(op.addr);
+					op.result = accepted[op.fd].front();
+					accepted[op.fd].erase(accepted[op.fd].begin());
+					getpeername(op.result,(struct sockaddr*)&op.addr,&length);
+				}
+				else if ((op.fd >= 0) && (op.fd < MaxFds) && (accept_error[op.fd]))
+				{
+					op.result = accept_error[op.fd];
+					accept_error[op.fd] = 0;
+				}
+				else if ((op.fd >= 0) && (op.fd < MaxFds) && (!accepting[op.fd]))
+				{
+					op.result = AcceptOne(op.fd,&op.addr);
+				}
+				else
+				{
+					op.result = -EAGAIN;
+				}
+			break;
+			case OP_READ:
+				if (!(sqe = GetSqe()))
+				{
+					op.result = -EAGAIN;
+					break;
+				}
+				op.result = -EINPROGRESS;
+				sqe->opcode = IORING_OP_RECV;
+				sqe->fd = op.fd;
+				sqe->addr = (unsigned long long)op.buf;
+				sqe->len = op.len;
+				sqe->msg_flags = MSG_DONTWAIT;
+				sqe->user_data = UD(UD_OP,batch,i);
+				outstanding++;
+			break;
+			case OP_WRITEV:
+				memset(&op.msg,0,sizeof(op.msg));
+				op.msg.msg_iov = op.iov;
+				op.msg.msg_iovlen = op.iovcnt;
+				if (!(sqe = GetSqe()))
+				{
+					op.result = -EAGAIN;
+					break;
+				}
+				op.result = -EINPROGRESS;
+				sqe->opcode = IORING_OP_SENDMSG;
+				sqe->fd = op.fd;
+				sqe->addr = (unsigned long long)&op.msg;
+				sqe->len = 1;
+				sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+				sqe->user_data = UD(UD_OP,batch,i);
+				outstanding++;
+			break;
+			default:
+				op.result = -EINVAL;
+			break;
+		}
+	}
+
+	/* the sqes point into ops, so this must not return while the kernel
+	 * still has any of them. io_uring_enter() failing with EAGAIN or
+	 * ENOMEM usually passes, so it is tried again. If it keeps failing
+	 * the ops the kernel hasn't taken yet are taken back and done here,
+	 * and the ones it has are waited for by watching the completion
+	 * ring, which they reach without any help from us */
+	while (outstanding > 0)
+	{
+		if ((Enter(outstanding,-1) < 0) && (errno != EINTR) && (errno != EBUSY) && (errno != ETIME))
+		{
+			if (++failures == 8)
+			{
+				debug("IOUringEngine: io_uring_enter keeps failing, finishing the batch without it");
+				Reclaim();
+			}
+			usleep(1000);
+		}
+		Reap();
+	}
+	inflight = NULL;
+}
+
+/* does op i of the batch in flight with an ordinary system call */
+
+void IOUringEngine::RunOp(unsigned int i)
+{
+	sockop &op = (*inflight)[i];
+
+	if (op.type == OP_READ)
+	{
+		op.result = recv(op.fd,op.buf,op.len,MSG_DONTWAIT);
+	}
+	else
+	{
+		op.result = sendmsg(op.fd,&op.msg,MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	if (op.result < 0)
+	{
+		op.result = -errno;
+	}
+	outstanding--;
+}
+
+/* takes back every sqe the kernel hasn't read yet. Ops of the batch in
+ * flight are done here with RunOp(), anything else (polls, cancels) is
+ * queued again */
+
+void IOUringEngine::Reclaim()
+{
+	unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *sq_tail;
+	vector<struct io_uring_sqe> keep;
+
+	for (unsigned k = head; k != tail; k++)
+	{
+		struct io_uring_sqe* sqe = &sqes[sq_array[k & *sq_mask]];
+		unsigned long long ud = sqe->user_data;
+		unsigned int i = ud & 0xffffffff;
+
+		if ((ud >> 56) != UD_OP)
+		{
+			keep.push_back(*sqe);
+		}
+		else if ((((ud >> 32) & 0xffffff) == (batch & 0xffffff)) && (i < inflight->size()) && ((*inflight)[i].result == -EINPROGRESS))
+		{
+			RunOp(i);
+		}
+	}
+	/* the kernel only reads the ring inside io_uring_enter(), so the
+	 * tail can be wound back safely */
+	__atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+	pending = 0;
+	for (unsigned int k = 0; k < keep.size(); k++)
+	{
+		struct io_uring_sqe* sqe = GetSqe();
+		if (sqe)
+		{
+			*sqe = keep[k];
+		}
+	}
+}
+
+const char* IOUringEngine::GetName()
+{
+	return "io_uring";
+}
+
+#endif
+
+/* portable poll(2) engine, used where epoll isn't available. Still O(n) in
+ * the kernel, but unlike select() it has no FD_SETSIZE ceiling */
+
+class PollEngine : public SocketEngine
+{
+	vector<struct pollfd> fds;
+	vector<int> slot;	/* position of each fd within fds */
+ public:
+	PollEngine(int maxfds);
+	virtual ~PollEngine();
+	virtual bool AddFd(int fd, int type);
+	virtual bool DelFd(int fd);
+	virtual bool WantWrite(int fd, bool want);
+	virtual int Wait(vector<sockevent> &ready, int timeout);
+	virtual const char* GetName();
+};
+
+PollEngine::PollEngine(int maxfds) : SocketEngine(maxfds), slot(maxfds,-1)
+{
+	debug("PollEngine: max fds %d",maxfds);
+}
+
+PollEngine::~PollEngine()
+{
+}
+
+bool PollEngine::AddFd(int fd, int type)
+{
+	struct pollfd p;
+
+	if ((fd < 0) || (fd >= MaxFds) || (ref[fd] != X_EMPTY_SLOT))
+	{
+		return false;
+	}
+	p.fd = fd;
+	p.events = POLLIN;
+	p.revents = 0;
+	slot[fd] = fds.size();
+	fds.push_back(p);
+	ref[fd] = type;
+	CurrentFds++;
+	return true;
+}
+
+bool PollEngine::DelFd(int fd)
+{
+	if ((fd < 0) || (fd >= MaxFds) || (ref[fd] == X_EMPTY_SLOT))
+	{
+		return false;
+	}
+	/* move the last entry into the hole so the array stays dense */
+	int s = slot[fd];
+	fds[s] = fds.back();
+	slot[fds[s].fd] = s;
+	fds.pop_back();
+	slot[fd] = -1;
+	ref[fd] = X_EMPTY_SLOT;
+	writing[fd] = 0;
+	CurrentFds--;
+	return true;
+}
+
+bool PollEngine::WantWrite(int fd, bool want)
+{
+	if ((fd < 0) || (fd >= MaxFds) || (ref[fd] == X_EMPTY_SLOT))
+	{
+		return false;
+	}
+	fds[slot[fd]].events = want ? (POLLIN | POLLOUT) : POLLIN;
+	writing[fd] = want;
+	return true;
+}
+
+int PollEngine::Wait(vector<sockevent> &ready, int timeout)
+{
+	int n = poll(fds.size() ? &fds[0] : NULL, fds.size(), timeout);
+
+	ready.clear();
+	for (unsigned int i = 0; (i < fds.size()) && ((int)ready.size() < n); i++)
+	{
+		if (fds[i].revents)
+		{
+			sockevent s;
+			s.fd = fds[i].fd;
+			s.type = GetType(s.fd);
+			s.flags = 0;
+			if (fds[i].revents & POLLIN)
+				s.flags |= EVENT_READ;
+			if (fds[i].revents & POLLOUT)
+				s.flags |= EVENT_WRITE;
+			if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+				s.flags |= EVENT_ERROR;
+			ready.push_back(s);
+		}
+	}
+	return n;
+}
+
+const char* PollEngine::GetName()
+{
+	return "poll";
+}
+
+SocketEngine* CreateSocketEngine(int maxfds, const char* name)
+{
+	if (!name)
+	{
+		name = "";
+	}
+#ifdef USE_IOURING
+	if (!strcmp(name,"io_uring"))
+	{
+		IOUringEngine* u = new IOUringEngine(maxfds);
+		if (u->Ok())
+		{
+			return u;
+		}
+		debug("CreateSocketEngine: io_uring unavailable, falling back");
+		delete u;
+	}
+#endif
+#ifdef USE_EPOLL
+	if (strcmp(name,"poll"))
+	{
+		EPollEngine* e = new EPollEngine(maxfds);
+		if (e->Ok())
+		{
+			return e;
+		}
+		debug("CreateSocketEngine: epoll unavailable, falling back to poll");
+		delete e;
+	}
+#endif
+	return new PollEngine(maxfds);
+}
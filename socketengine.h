@@ -0,0 +1,104 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  Inspire is copyright (C) 2002-2003 ChatSpike-Dev.
+ *                       E-mail:
+ *                <brain@chatspike.net>
+ *           	  <Craig@chatspike.net>
+ *
+ * Written by Craig Edwards, Craig McLure, and others.
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd_config.h"
+#include <vector>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#ifndef __SOCKETENGINE_H__
+#define __SOCKETENGINE_H__
+
+/* types of descriptor the engine can watch */
+
+#define X_EMPTY_SLOT    0
+#define X_LISTEN        1
+#define X_ESTAB_CLIENT  2
+#define X_RESOLVER      3
+
+/* readiness flags reported back by SocketEngine::Wait() */
+
+#define EVENT_READ      1
+#define EVENT_WRITE     2
+#define EVENT_ERROR     4
+
+/* one ready descriptor, as returned by SocketEngine::Wait() */
+
+struct sockevent {
+	int fd;
+	int type;	/* X_LISTEN, X_ESTAB_CLIENT or X_RESOLVER */
+	int flags;	/* EVENT_READ, EVENT_WRITE, EVENT_ERROR */
+};
+
+/* socket operations which can be handed to SocketEngine::Submit() */
+
+#define OP_ACCEPT       1
+#define OP_READ         2
+#define OP_WRITEV       3
+
+/* one socket operation. The caller fills in the request, Submit() fills in
+ * result with what the equivalent system call would have returned (bytes
+ * moved, or the new fd for OP_ACCEPT), or -errno if it failed. Nothing
+ * ever blocks, an operation which would have gets -EAGAIN */
+
+struct sockop {
+	int type;		/* OP_ACCEPT, OP_READ or OP_WRITEV */
+	int fd;
+	char* buf;		/* OP_READ: where to put the data */
+	int len;		/* OP_READ: size of buf */
+	struct iovec* iov;	/* OP_WRITEV: data to send */
+	int iovcnt;
+	struct sockaddr_in addr;	/* OP_ACCEPT: address of the new client */
+	struct msghdr msg;	/* scratch space for the engine */
+	int result;
+};
+
+// class SocketEngine is the interface the main loop uses to find out which
+// descriptors are ready, so that it never has to poll idle clients, and to
+// accept, read and write in batches. There is one implementation per
+// operating system facility, chosen by CreateSocketEngine()
+
+class SocketEngine
+{
+ protected:
+	std::vector<char> ref;	/* descriptor type, indexed by fd */
+	std::vector<char> writing;	/* true if EVENT_WRITE is wanted, indexed by fd */
+	int MaxFds;
+	int CurrentFds;
+ public:
+	SocketEngine(int maxfds);
+	virtual ~SocketEngine();
+	virtual bool AddFd(int fd, int type) = 0;
+	virtual bool DelFd(int fd) = 0;
+	virtual bool WantWrite(int fd, bool want) = 0;
+	virtual int Wait(std::vector<sockevent> &events, int timeout) = 0;
+	virtual void Submit(std::vector<sockop> &ops);
+	virtual const char* GetName() = 0;
+	int GetType(int fd);
+	int GetMaxFds();
+	int GetCurrentFds();
+};
+
+/* raises the descriptor limit as far as the system allows and returns it */
+int RaiseFdLimit(void);
+
+/* returns the named engine ("io_uring", "epoll" or "poll"), or the best
+ * one available on this system if that one can't be had */
+SocketEngine* CreateSocketEngine(int maxfds, const char* name);
+
+#endif
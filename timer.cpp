@@ -0,0 +1,156 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  Inspire is copyright (C) 2002-2003 ChatSpike-Dev.
+ *                       E-mail:
+ *                <brain@chatspike.net>
+ *           	  <Craig@chatspike.net>
+ *
+ * Written by Craig Edwards, Craig McLure, and others.
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd.h"
+#include "timer.h"
+
+/* a hashed timing wheel with one second resolution. Each slot is a circular
+ * list headed by a dummy entry, so adding and removing a timer is O(1) and
+ * RunTimers() only looks at the slots for the seconds which have passed
+ * since it last ran, instead of at every client */
+
+static struct timerec wheel[TIMER_SLOTS];
+static time_t lastrun = 0;
+static int timercount = 0;
+
+static void InitWheel(void)
+{
+	for (int i = 0; i < TIMER_SLOTS; i++)
+	{
+		wheel[i].prev = wheel[i].next = &wheel[i];
+	}
+}
+
+static void LinkTimer(struct timerec* head, struct timerec* timer)
+{
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+static void UnlinkTimer(struct timerec* timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->prev = timer->next = NULL;
+}
+
+timerec::timerec() : expires(0), handler(NULL), data(NULL), prev(NULL), next(NULL)
+{
+}
+
+timerec::~timerec()
+{
+	DelTimer(this);
+}
+
+void AddTimer(struct timerec* timer, time_t when, timer_handler handler, void* data)
+{
+	if (!wheel[0].next)
+	{
+		InitWheel();
+	}
+	DelTimer(timer);
+	if (when <= lastrun)
+	{
+		/* that slot has already been run, make it due next time round */
+		when = lastrun + 1;
+	}
+	timer->expires = when;
+	timer->handler = handler;
+	timer->data = data;
+	LinkTimer(&wheel[when % TIMER_SLOTS],timer);
+	timercount++;
+}
+
+void DelTimer(struct timerec* timer)
+{
+	if (timer->next)
+	{
+		UnlinkTimer(timer);
+		timercount--;
+	}
+}
+
+void RunTimers(time_t now)
+{
+	struct timerec due;
+	time_t t;
+
+	if ((!timercount) || (now <= lastrun))
+	{
+		lastrun = now;
+		return;
+	}
+	/* after a long stall (or on the first run) every slot is due */
+	t = ((!lastrun) || (now - lastrun > TIMER_SLOTS)) ? now - TIMER_SLOTS + 1 : lastrun + 1;
+	lastrun = now;
+
+	due.prev = due.next = &due;
+	for (; t <= now; t++)
+	{
+		struct timerec* head = &wheel[t % TIMER_SLOTS];
+		struct timerec* i = head->next;
+
+		/* move the expired ones out first, the handlers are free to
+		 * add and remove timers (including each other) as they go */
+		while (i != head)
+		{
+			struct timerec* n = i->next;
+			if (i->expires <= now)
+			{
+				UnlinkTimer(i);
+				LinkTimer(&due,i);
+			}
+			i = n;
+		}
+	}
+	while (due.next != &due)
+	{
+		struct timerec* i = due.next;
+		UnlinkTimer(i);
+		timercount--;
+		i->handler(i,now);
+	}
+	due.prev = due.next = NULL;
+}
+
+time_t NextTimer(time_t now)
+{
+	time_t next = 0;
+
+	if (!timercount)
+	{
+		return 0;
+	}
+	for (time_t t = now + 1; t <= now + TIMER_SLOTS; t++)
+	{
+		struct timerec* head = &wheel[t % TIMER_SLOTS];
+		for (struct timerec* i = head->next; i != head; i = i->next)
+		{
+			if ((!next) || (i->expires < next))
+			{
+				next = i->expires;
+			}
+		}
+		if ((next) && (next <= t))
+		{
+			break;
+		}
+	}
+	return next;
+}
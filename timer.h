@@ -0,0 +1,58 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  Inspire is copyright (C) 2002-2003 ChatSpike-Dev.
+ *                       E-mail:
+ *                <brain@chatspike.net>
+ *           	  <Craig@chatspike.net>
+ *
+ * Written by Craig Edwards, Craig McLure, and others.
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include <time.h>
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+/* number of one second slots in the timer wheel. Timers further away than
+ * this just go round the wheel more than once */
+
+#define TIMER_SLOTS 256
+
+struct timerec;
+
+typedef void (*timer_handler)(struct timerec* timer, time_t now);
+
+/* a single timer. These are normally embedded in whatever they belong to
+ * (e.g. the userrec), and take themselves off the wheel when destroyed so
+ * a deleted record can never fire */
+
+struct timerec {
+	time_t expires;		/* when the timer is due */
+	timer_handler handler;	/* called when the timer is due */
+	void* data;		/* owner of the timer, for the handler */
+	struct timerec* prev;	/* wheel slot links, NULL when not scheduled */
+	struct timerec* next;
+
+	timerec();
+	~timerec();
+};
+
+/* (re)schedules a timer to call handler(timer) at the given time */
+void AddTimer(struct timerec* timer, time_t when, timer_handler handler, void* data);
+
+/* takes a timer off the wheel, does nothing if it isn't scheduled */
+void DelTimer(struct timerec* timer);
+
+/* fires every timer which is due at or before now */
+void RunTimers(time_t now);
+
+/* returns when the next timer is due, or 0 if none are scheduled */
+time_t NextTimer(time_t now);
+
+#endif
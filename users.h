@@ -1,5 +1,11 @@
 #include "inspircd_config.h" 
 #include "channels.h" 
+#include "timer.h"
+#include "dns.h"
+#include <string>
+#include <deque>
+#include <stdlib.h>
+#include <string.h>
  
 #ifndef __USERS_H__ 
 #define __USERS_H__ 
@@ -9,6 +15,66 @@
 #define STATUS_VOICE  1 
 #define STATUS_NORMAL 0 
  
+/* user modes whose holders are kept in a list of their own, so that
+ * notices for them and the counts LUSERS gives don't have to look at
+ * every client. UMODE_INDEXES is the number of modes in UMODE_INDEXED,
+ * see set_umode() */
+#define UMODE_INDEXED "oiw"
+#define UMODE_INDEXES (sizeof(UMODE_INDEXED) - 1)
+ 
+// class sendline is one line of output waiting in a sendQ. Copies share
+// the same bytes, so a line going to a whole channel is formatted once and
+// every member's sendQ refers to it. It is freed when the last copy goes
+
+class sendline
+{
+	struct linebuf {
+		int refs;
+		int len;
+		char data[1];
+	};
+	linebuf* buf;
+ public:
+	sendline(const char* data, int len)
+	{
+		buf = (linebuf*)malloc(sizeof(linebuf) + len);
+		buf->refs = 1;
+		buf->len = len;
+		memcpy(buf->data,data,len);
+	}
+	sendline(const sendline &line) : buf(line.buf)
+	{
+		buf->refs++;
+	}
+	~sendline()
+	{
+		if (!--buf->refs)
+		{
+			free(buf);
+		}
+	}
+	sendline& operator=(const sendline &line)
+	{
+		line.buf->refs++;
+		if (!--buf->refs)
+		{
+			free(buf);
+		}
+		buf = line.buf;
+		return *this;
+	}
+	const char* data() const
+	{
+		return buf->data;
+	}
+	int length() const
+	{
+		return buf->len;
+	}
+};
+
+struct listrec;
+
 struct userrec {
 	char nick[NICKMAX];    /* nickname, null if no NICK yet */
 	unsigned long ip;      /* ipv4 IP address */
@@ -18,13 +84,25 @@ struct userrec {
 	char fullname[128]; /* user full name */
 	int fd;		       /* file descriptor (socket number) */
 	char modes[32];	       /* user modes and other bits and bobs, NO CHANNEL MODES! */
-	char inbuf[MAXBUF];    /* input buffer (recvQ) */
+	std::string recvq;     /* input buffer (recvQ), may hold several lines */
+	std::deque<sendline> sendq; /* output lines (sendQ) not yet written */
+	unsigned int sendqpos; /* bytes of sendq.front() already written */
+	long sendqlen;	       /* bytes waiting in the sendq */
 	time_t lastping;       /* time client was last pinged */
 	time_t signon;         /* time client signed on */
 	time_t idle_lastmsg;   /* last msg from client, used as idle time */
 	time_t nping;	       /* ping timeout timer */
+	struct timerec pingtimer; /* fires at nping to send a PING or time out */
+	struct timerec regtimer;  /* disconnects the client if it never registers */
+	struct dnsrec dns;     /* reverse lookup of the client's address */
+	int dns_done;	       /* true once the lookup has finished, either way */
 	int registered;        /* true if client has registered USER and NICK */
-	struct ucrec chans[MAXCHANS]; /* pointers to channels user is on plus ucmodes */
+	int validnick;	       /* isnick(nick), false until the client sends a NICK */
+	int runnable;	       /* true while queued in run_list with lines to process */
+	unsigned long epoch;   /* last fan-out this user was sent, see WriteCommon() */
+	std::vector<struct ucrec*> chans; /* channels the user is on, sorted by address, see find_ucrec() */
+	struct listrec* listing; /* LIST still being sent, see ListChannels() */
+	unsigned int umode_pos[UMODE_INDEXES]; /* where the user is in each umode_users list */
 	char server[256];	/* server the user is connected to */
 	char awaymsg[512];
 	int port;		/* port the user is connected on, for reference only */